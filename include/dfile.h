@@ -2,6 +2,7 @@
 #define DFILE_H
 #include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 /* Copyright 2025 Richard N Van Natta
  *
  * This file is part of the DFILE stdio alternative.
@@ -50,6 +51,13 @@ long long int d_ftell(DFILE * f);
 int d_feof_unlocked(DFILE * f);
 int d_ferror_unlocked(DFILE * f);
 void d_clearerror_unlocked(DFILE * f);
+// readiness queries for streams opened with the 'n' nonblocking flag.
+// pending_write is the number of bytes the fd hasn't accepted yet, so
+// wait for writability and d_fflush while it's nonzero. buffered_read
+// is the number of bytes that can be read without touching the fd, a
+// poller won't report those as readable
+int d_fpending_write_unlocked(DFILE * f);
+int d_fbuffered_read_unlocked(DFILE * f);
 
 int d_setvbuf(DFILE * f, char * buf, int mode, size_t size);
 void d_setbuf(DFILE * f, char buf[D_BUFSIZ]);
@@ -61,6 +69,11 @@ void d_flockfile(DFILE * f);
 int d_ftrylockfile(DFILE * f);
 void d_funlockfile(DFILE * f);
 
+// like glibc's __fsetlocking. with BYCALLER the locked calls on f
+// behave like the unlocked ones and the caller does its own locking
+enum { D_FSETLOCKING_QUERY, D_FSETLOCKING_INTERNAL, D_FSETLOCKING_BYCALLER };
+int d_fsetlocking(DFILE * f, int type);
+
 DFILE * d_fdopen(int fd, char const * flags);
 DFILE * d_fopen(char const * path, char const * mode);
 DFILE * d_popen(char const * cmd, char const * mode);
@@ -78,6 +91,11 @@ int d_pclose(DFILE * f);
 
 int d_fwrite_unlocked(const void * ptr, int ct, DFILE * f);
 int d_fread_unlocked(void * ptr, int ct, DFILE * f);
+// write straight into the stream's buffer. reserve returns space for ct
+// bytes, flushing to make room, or NULL if ct won't fit in the buffer.
+// commit then adds the first ct of those bytes to the stream
+char * d_freserve_unlocked(DFILE * f, int ct);
+int d_fcommit_unlocked(DFILE * f, int ct);
 char * d_fgets_unlocked(char * buf, int ct, DFILE * f);
 int d_ungetc(int c, DFILE * f);
 
@@ -100,6 +118,9 @@ DFILE * d_open_memstream(char ** buf, size_t * tell);
 // opens a string for reading: EOF occures at the nul terminator
 // this stream opens in O(1) time, ie it does not call strlen on str
 DFILE * d_open_strstream(char const * str);
+// opens a read stream of the base64 decoded contents of src, skipping
+// whitespace and ending at padding. closing it does not close src
+DFILE * d_open_base64stream(DFILE * src);
 
 DFILE * d_fdreopen(int fd, char const * mode, DFILE * f);
 DFILE * d_freopen(char const * path, char const * mode, DFILE * f);
@@ -137,6 +158,8 @@ void d_clearerror(DFILE * f);
 
 int d_fileno(DFILE * f);
 int d_fflush(DFILE * f);
+int d_fpending_write(DFILE * f);
+int d_fbuffered_read(DFILE * f);
 
 int d_fwrite(const void * ptr, int ct, DFILE * f);
 int d_fread(void * ptr, int ct, DFILE * f);
@@ -173,6 +196,149 @@ D_PRINT_ATTR(2, 0) int d_vfprintf(DFILE * f, char const * fmt, va_list args);
 D_PRINT_ATTR(3, 0) int d_vsnprintf(char * buf, size_t size, char const * fmt, va_list args);
 D_PRINT_ATTR(2, 0) int d_vsprintf(char * buf, char const * fmt, va_list args);
 D_PRINT_ATTR(2, 0) int d_vasprintf(char ** buf, char const * fmt, va_list args);
+// the length d_printf would print, without printing anything
+D_PRINT_ATTR(1, 2) int d_printf_len(char const * fmt, ...);
+D_PRINT_ATTR(1, 0) int d_vprintf_len(char const * fmt, va_list args);
+
+// asprintf into caller owned memory, like a per request bump allocator,
+// so the string costs no malloc or free. alloc is called once with the
+// length including the nul. returns NULL if formatting or alloc fails
+typedef void * d_arena_alloc_function_t(void * cookie, size_t size);
+typedef struct {
+  d_arena_alloc_function_t *alloc;
+  void * cookie;
+} d_arena;
+D_PRINT_ATTR(2, 3) char * d_asprintf_arena(d_arena const * arena, char const * fmt, ...);
+D_PRINT_ATTR(2, 0) char * d_vasprintf_arena(d_arena const * arena, char const * fmt, va_list args);
+
+// parses fmt once so hot formats skip the parsing on every call.
+// returns NULL for a malformed format. the program doesn't refer to
+// fmt after compiling
+typedef struct d_fmt d_fmt;
+d_fmt * d_fmt_compile(char const * fmt);
+void d_fmt_free(d_fmt * prog);
+int d_fprintf_compiled(DFILE * f, d_fmt const * prog, ...);
+int d_vfprintf_compiled(DFILE * f, d_fmt const * prog, va_list args);
+
+// prints each element of arr with spec, a single conversion like
+// "%.3f" or "%08x", with sep between them. returns the number of chars
+// printed. the integer versions print unsigned conversions from the
+// element's bits
+int d_fprint_f32s(DFILE * f, float const * arr, size_t n, char const * sep, char const * spec);
+int d_fprint_f64s(DFILE * f, double const * arr, size_t n, char const * sep, char const * spec);
+int d_fprint_i32s(DFILE * f, int32_t const * arr, size_t n, char const * sep, char const * spec);
+int d_fprint_i64s(DFILE * f, int64_t const * arr, size_t n, char const * sep, char const * spec);
+
+// registers fn to print %<label>, with the usual flags, width and
+// precision parsed into spec (see dprintf.h). fn runs with f locked, so
+// it should use the _unlocked calls, d_freserve_unlocked and
+// d_fcommit_unlocked to format in place, falling back to
+// d_fwrite_unlocked when reserve returns NULL. it takes its arguments
+// with va_arg(*args, ...) and returns the number of chars printed or -1.
+// registering a label again replaces it, and NULL unregisters it. not
+// thread safe: register before other threads print with the label
+struct print_specifier;
+typedef int d_printf_function_t(DFILE * f, struct print_specifier const * spec, va_list * args);
+int d_register_printf(char const * label, d_printf_function_t * fn);
+
+// print one value with a specifier parsed ahead of time, without a
+// va_list, for bindings like dfile.hpp. spec can't have * width or
+// precision, and its kind has to suit the value, else they return -1
+int d_fprint_int_unlocked(DFILE * f, struct print_specifier const * spec, int64_t i);
+int d_fprint_uint_unlocked(DFILE * f, struct print_specifier const * spec, uint64_t u);
+int d_fprint_double_unlocked(DFILE * f, struct print_specifier const * spec, double d);
+int d_fprint_float_unlocked(DFILE * f, struct print_specifier const * spec, float d);
+int d_fprint_str_unlocked(DFILE * f, struct print_specifier const * spec, char const * str, size_t len);
+int d_fprint_ptr_unlocked(DFILE * f, struct print_specifier const * spec, void const * ptr);
+
+// print a single value the way %lld, %llu, %rg or %s would, without
+// parsing a format. f64 and f32 print the shortest roundtrip digits
+int d_fput_i64_unlocked(int64_t i, DFILE * f);
+int d_fput_u64_unlocked(uint64_t u, DFILE * f);
+int d_fput_f64_unlocked(double d, DFILE * f);
+int d_fput_f32_unlocked(float d, DFILE * f);
+int d_fput_str_unlocked(char const * str, DFILE * f);
+int d_fput_i64(int64_t i, DFILE * f);
+int d_fput_u64(uint64_t u, DFILE * f);
+int d_fput_f64(double d, DFILE * f);
+int d_fput_f32(float d, DFILE * f);
+int d_fput_str(char const * str, DFILE * f);
+// str's first len bytes as a quoted json string, or null if str is
+// NULL. %<json> prints a char * the same way, bounded by precision
+int d_fput_json_string_unlocked(char const * str, size_t len, DFILE * f);
+int d_fput_json_string(char const * str, size_t len, DFILE * f);
+// %<time> reads CLOCK_REALTIME_COARSE instead of the precise clock
+// when coarse is set, where the platform has it. returns the previous
+// setting, or -1 with ENOTSUP if there's no coarse clock
+int d_settimecoarse(int coarse);
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+// d_print(f, "x=", x, " y=", y, "\n") prints up to 16 values under one
+// lock, picking the emitter by each argument's type. char prints as a
+// character, but note character literals are ints. it is a void
+// expression, check d_ferror for failures. f is evaluated more than once
+#define D_PUT_(f, x) _Generic((x), \
+  _Bool: d_fput_u64_unlocked, \
+  char: d_fputc_unlocked, \
+  signed char: d_fput_i64_unlocked, \
+  short: d_fput_i64_unlocked, \
+  int: d_fput_i64_unlocked, \
+  long: d_fput_i64_unlocked, \
+  long long: d_fput_i64_unlocked, \
+  unsigned char: d_fput_u64_unlocked, \
+  unsigned short: d_fput_u64_unlocked, \
+  unsigned int: d_fput_u64_unlocked, \
+  unsigned long: d_fput_u64_unlocked, \
+  unsigned long long: d_fput_u64_unlocked, \
+  float: d_fput_f32_unlocked, \
+  double: d_fput_f64_unlocked, \
+  long double: d_fput_f64_unlocked, \
+  char *: d_fput_str_unlocked, \
+  char const *: d_fput_str_unlocked)((x), (f))
+#define D_PUT1_(f, x) D_PUT_(f, x)
+#define D_PUT2_(f, x, ...) D_PUT_(f, x), D_PUT1_(f, __VA_ARGS__)
+#define D_PUT3_(f, x, ...) D_PUT_(f, x), D_PUT2_(f, __VA_ARGS__)
+#define D_PUT4_(f, x, ...) D_PUT_(f, x), D_PUT3_(f, __VA_ARGS__)
+#define D_PUT5_(f, x, ...) D_PUT_(f, x), D_PUT4_(f, __VA_ARGS__)
+#define D_PUT6_(f, x, ...) D_PUT_(f, x), D_PUT5_(f, __VA_ARGS__)
+#define D_PUT7_(f, x, ...) D_PUT_(f, x), D_PUT6_(f, __VA_ARGS__)
+#define D_PUT8_(f, x, ...) D_PUT_(f, x), D_PUT7_(f, __VA_ARGS__)
+#define D_PUT9_(f, x, ...) D_PUT_(f, x), D_PUT8_(f, __VA_ARGS__)
+#define D_PUT10_(f, x, ...) D_PUT_(f, x), D_PUT9_(f, __VA_ARGS__)
+#define D_PUT11_(f, x, ...) D_PUT_(f, x), D_PUT10_(f, __VA_ARGS__)
+#define D_PUT12_(f, x, ...) D_PUT_(f, x), D_PUT11_(f, __VA_ARGS__)
+#define D_PUT13_(f, x, ...) D_PUT_(f, x), D_PUT12_(f, __VA_ARGS__)
+#define D_PUT14_(f, x, ...) D_PUT_(f, x), D_PUT13_(f, __VA_ARGS__)
+#define D_PUT15_(f, x, ...) D_PUT_(f, x), D_PUT14_(f, __VA_ARGS__)
+#define D_PUT16_(f, x, ...) D_PUT_(f, x), D_PUT15_(f, __VA_ARGS__)
+// past the limit, a static assert in an expression: one inside a
+// struct inside sizeof
+#define D_PUT_TOO_MANY_(f, ...) \
+  sizeof(struct { _Static_assert(0, "d_print takes at most 16 values"); int d_print_; })
+#define D_PUT_NTH_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, \
+  _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, N, ...) N
+#define d_print(f, ...) ((void)(d_flockfile(f), \
+  D_PUT_NTH_(__VA_ARGS__, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, \
+    D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, \
+    D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, \
+    D_PUT_TOO_MANY_, D_PUT_TOO_MANY_, D_PUT16_, D_PUT15_, D_PUT14_, D_PUT13_, D_PUT12_, \
+    D_PUT11_, D_PUT10_, D_PUT9_, D_PUT8_, D_PUT7_, D_PUT6_, D_PUT5_, D_PUT4_, D_PUT3_, \
+    D_PUT2_, D_PUT1_, ~)(f, __VA_ARGS__), \
+  d_funlockfile(f)))
+#endif
+
+// deferred logging: while set, printf on f writes a binary record of
+// the format's address and the raw arguments instead of formatting,
+// with the format's text written the first time f sees it. the
+// format's address has to keep meaning the same text, as a literal
+// does. printf returns 0 or -1, and %n stores 0. other writes to f are
+// wrapped in records of their own, 13 bytes of header each, and
+// d_freserve_unlocked returns NULL. returns whether f was deferred
+// before, or -1 if turning it on ran out of memory
+int d_fsetdeferred(DFILE * f, int deferred);
+// renders the records read from in as text on out. returns the number
+// of printfs rendered, or -1 for a read or write error or a bad record
+int d_fdecode_deferred(DFILE * in, DFILE * out);
 
 int d_scanf(char const * fmt, ...);
 int d_fscanf(DFILE * f, char const * fmt, ...);
@@ -0,0 +1,382 @@
+#ifndef DFILE_HPP
+#define DFILE_HPP
+/* Copyright 2025 Richard N Van Natta
+ *
+ * This file is part of the DFILE stdio alternative.
+ *
+ * DFILE is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 2 of the License, or (at
+ * your option) any later version.
+ *
+ * DFILE is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with DFILE.
+ *
+ * If not, see <https://www.gnu.org/licenses/>.
+ *
+ * If not, visit <https://github.com/rnvannatta>
+ */
+
+// C++20 front end: d::print(f, "x={} y={:.3f}\n", x, y)
+//
+// the format is parsed at compile time into print_specifiers, and each
+// argument goes straight to the printer for its type, so there's no
+// va_arg and no runtime parsing. a bad format or a type that doesn't
+// suit its field is a compile error.
+//
+// fields are {} or {:spec} where spec is [[ ]<|>][+| |-][#][0][width][.precision][type]
+// and type is one of the printf conversions d x X o b c f F e E g G a A s p.
+// like std::format, {} prints floats with their shortest roundtrip
+// digits, in fixed or scientific form whichever is shorter, and strings
+// are left justified by default. {{ and }} print braces
+
+extern "C" {
+#include "dfile.h"
+#include "dprintf.h"
+}
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace d {
+namespace detail {
+
+enum class arg_kind { sint, uint, chr, boolean, f32, f64, str, ptr };
+
+template<class T>
+consteval arg_kind kind_of() {
+  using U = std::remove_cv_t<std::decay_t<T>>;
+  if constexpr(std::is_same_v<U, bool>)
+    return arg_kind::boolean;
+  else if constexpr(std::is_same_v<U, char>)
+    return arg_kind::chr;
+  else if constexpr(std::is_integral_v<U> && std::is_signed_v<U>)
+    return arg_kind::sint;
+  else if constexpr(std::is_integral_v<U>)
+    return arg_kind::uint;
+  else if constexpr(std::is_same_v<U, float>)
+    return arg_kind::f32;
+  else if constexpr(std::is_floating_point_v<U>)
+    return arg_kind::f64;
+  else if constexpr(std::is_convertible_v<U, std::string_view>)
+    return arg_kind::str;
+  else if constexpr(std::is_pointer_v<U> || std::is_null_pointer_v<U>)
+    return arg_kind::ptr;
+  else
+    static_assert(!sizeof(U), "d::print can't print this type");
+}
+
+// not constexpr, so reaching it while parsing fails the compile
+void format_error(char const * msg);
+
+struct literal {
+  char const * text;
+  int len;
+  bool escaped;
+};
+
+consteval bool is_digit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+consteval print_specifier parse_field(std::string_view s, arg_kind kind) {
+  print_specifier spec = {};
+  spec.kind_width = PRINT_WORD;
+  spec.precision = -1;
+  size_t i = 0;
+
+  bool aligned = false;
+  if(s.size() >= 2 && (s[1] == '<' || s[1] == '>')) {
+    if(s[0] != ' ')
+      format_error("only space fill is supported");
+    i = 1;
+  }
+  if(i < s.size() && (s[i] == '<' || s[i] == '>')) {
+    if(s[i] == '<')
+      spec.flags |= PRINT_LEFT_JUSTIFY;
+    aligned = true;
+    i++;
+  } else if(i < s.size() && s[i] == '^') {
+    format_error("centering is not supported");
+  }
+  if(i < s.size() && (s[i] == '+' || s[i] == ' ' || s[i] == '-')) {
+    if(s[i] == '+')
+      spec.flags |= PRINT_SIGN;
+    else if(s[i] == ' ')
+      spec.flags |= PRINT_SPACE;
+    i++;
+  }
+  if(i < s.size() && s[i] == '#') {
+    spec.flags |= PRINT_ALTER;
+    i++;
+  }
+  if(i < s.size() && s[i] == '0') {
+    spec.flags |= PRINT_ZERO_EXTEND;
+    i++;
+  }
+  while(i < s.size() && is_digit(s[i]))
+    spec.field_width = spec.field_width * 10 + (s[i++] - '0');
+  if(i < s.size() && s[i] == '.') {
+    i++;
+    if(i == s.size() || !is_digit(s[i]))
+      format_error("missing precision");
+    spec.precision = 0;
+    while(i < s.size() && is_digit(s[i]))
+      spec.precision = spec.precision * 10 + (s[i++] - '0');
+  }
+  char type = 0;
+  if(i < s.size())
+    type = s[i++];
+  if(i != s.size())
+    format_error("malformed field");
+
+  bool is_int = kind == arg_kind::sint || kind == arg_kind::uint || kind == arg_kind::chr;
+  bool is_float = kind == arg_kind::f32 || kind == arg_kind::f64;
+  switch(type) {
+    case 0:
+      switch(kind) {
+        case arg_kind::sint: spec.print_kind = PRINT_INT; break;
+        case arg_kind::uint: spec.print_kind = PRINT_UINT; break;
+        case arg_kind::chr: spec.print_kind = PRINT_CHAR; break;
+        case arg_kind::boolean:
+        case arg_kind::str: spec.print_kind = PRINT_STRING; break;
+        case arg_kind::ptr: spec.print_kind = PRINT_POINTER; break;
+        case arg_kind::f32:
+        case arg_kind::f64:
+          spec.print_kind = PRINT_GENERAL;
+          if(spec.precision < 0)
+            spec.flags |= PRINT_ROUNDTRIP;
+          break;
+      }
+      break;
+    case 'd': spec.print_kind = kind == arg_kind::uint ? PRINT_UINT : PRINT_INT; break;
+    case 'X': spec.flags |= PRINT_ALLCAPS; [[fallthrough]];
+    case 'x': spec.print_kind = PRINT_HEX; break;
+    case 'o': spec.print_kind = PRINT_OCTAL; break;
+    case 'b': spec.print_kind = PRINT_BINARY; break;
+    case 'c': spec.print_kind = PRINT_CHAR; break;
+    case 'F': spec.flags |= PRINT_ALLCAPS; [[fallthrough]];
+    case 'f': spec.print_kind = PRINT_DOUBLE; break;
+    case 'E': spec.flags |= PRINT_ALLCAPS; [[fallthrough]];
+    case 'e': spec.print_kind = PRINT_EXPONENT; break;
+    case 'G': spec.flags |= PRINT_ALLCAPS; [[fallthrough]];
+    case 'g': spec.print_kind = PRINT_GENERAL; break;
+    case 'A': spec.flags |= PRINT_ALLCAPS; [[fallthrough]];
+    case 'a': spec.print_kind = PRINT_HEXPONENT; break;
+    case 's': spec.print_kind = PRINT_STRING; break;
+    case 'p': spec.print_kind = PRINT_POINTER; break;
+    default: format_error("unknown type");
+  }
+
+  switch(spec.print_kind) {
+    case PRINT_INT: case PRINT_UINT: case PRINT_HEX:
+    case PRINT_OCTAL: case PRINT_BINARY: case PRINT_CHAR:
+      if(!is_int)
+        format_error("integer type on a non integer");
+      break;
+    case PRINT_DOUBLE: case PRINT_EXPONENT:
+    case PRINT_GENERAL: case PRINT_HEXPONENT:
+      if(!is_float)
+        format_error("float type on a non float");
+      break;
+    case PRINT_STRING:
+      if(kind != arg_kind::str && kind != arg_kind::boolean)
+        format_error("string type on a non string");
+      break;
+    case PRINT_POINTER:
+      if(kind != arg_kind::ptr)
+        format_error("pointer type on a non pointer");
+      break;
+  }
+  if(!aligned && (spec.print_kind == PRINT_STRING || spec.print_kind == PRINT_CHAR))
+    spec.flags |= PRINT_LEFT_JUSTIFY;
+  return spec;
+}
+
+template<class... Args>
+struct basic_format_string {
+  static constexpr size_t nargs = sizeof...(Args);
+  literal literals[nargs + 1];
+  print_specifier specs[nargs ? nargs : 1];
+
+  template<class S>
+    requires std::is_convertible_v<S const &, std::string_view>
+  consteval basic_format_string(S const & str) {
+    constexpr arg_kind kinds[] = { kind_of<Args>()..., arg_kind::str };
+    std::string_view s = str;
+    size_t n = 0, i = 0;
+    literal lit = { s.data(), 0, false };
+    while(i < s.size()) {
+      char c = s[i];
+      if((c == '{' || c == '}') && i + 1 < s.size() && s[i + 1] == c) {
+        lit.escaped = true;
+        i += 2;
+        continue;
+      }
+      if(c == '}')
+        format_error("unmatched }");
+      if(c != '{') {
+        i++;
+        continue;
+      }
+      lit.len = i - (lit.text - s.data());
+      size_t end = s.find('}', i);
+      if(end == std::string_view::npos)
+        format_error("unterminated field");
+      std::string_view field = s.substr(i + 1, end - i - 1);
+      if(!field.empty() && field[0] != ':')
+        format_error("positional fields are not supported");
+      if(n >= nargs)
+        format_error("more fields than arguments");
+      if(!field.empty())
+        field.remove_prefix(1);
+      literals[n] = lit;
+      specs[n] = parse_field(field, kinds[n]);
+      n++;
+      i = end + 1;
+      lit = { s.data() + i, 0, false };
+    }
+    if(n != nargs)
+      format_error("fewer fields than arguments");
+    lit.len = s.size() - (lit.text - s.data());
+    literals[n] = lit;
+    if(!nargs)
+      specs[0] = {};
+  }
+};
+
+inline int write_literal(DFILE * f, literal const & lit) {
+  if(!lit.escaped)
+    return d_fwrite_unlocked(lit.text, lit.len, f) == lit.len ? lit.len : -1;
+  // write through each doubled brace and skip its second half
+  int printed = 0;
+  char const * text = lit.text, * end = lit.text + lit.len;
+  while(text < end) {
+    char const * run = text;
+    while(run < end && *run != '{' && *run != '}')
+      run++;
+    if(run < end)
+      run++;
+    int len = run - text;
+    if(d_fwrite_unlocked(text, len, f) != len)
+      return -1;
+    printed += len;
+    text = run < end && run[-1] == *run ? run + 1 : run;
+  }
+  return printed;
+}
+
+// {} on a float: the shortest roundtrip digits, as fixed or scientific
+// whichever is shorter, fixed on a tie, the way std::to_chars picks.
+// the lengths follow from the digit count and exponent of the %re form
+template<class T>
+int emit_shortest(DFILE * f, print_specifier spec, T v) {
+  char buf[48];
+  if constexpr(std::is_same_v<T, float>)
+    d_snprintf(buf, sizeof buf, "%rhe", v);
+  else
+    d_snprintf(buf, sizeof buf, "%re", v);
+  // inf and nan have no exponent and print the same either way
+  if(char const * e = std::strchr(buf, 'e')) {
+    char const * digits = buf[0] == '-' ? buf + 1 : buf;
+    int n = e - digits > 1 ? e - digits - 1 : 1;
+    int exp = std::atoi(e + 1);
+    int sci = n + (n > 1) + 2 + (exp >= 100 || exp <= -100 ? 3 : 2);
+    int fixed = exp >= n - 1 ? exp + 1 : exp >= 0 ? n + 1 : n + 1 - exp;
+    spec.print_kind = fixed <= sci ? PRINT_DOUBLE : PRINT_EXPONENT;
+    // like to_chars, a whole number in fixed form gets its exact digits
+    // rather than the shortest ones padded with zeroes
+    if(fixed <= sci && exp >= n - 1) {
+      spec.flags &= ~PRINT_ROUNDTRIP;
+      spec.precision = 0;
+    }
+  }
+  if constexpr(std::is_same_v<T, float>)
+    return d_fprint_float_unlocked(f, &spec, v);
+  else
+    return d_fprint_double_unlocked(f, &spec, v);
+}
+
+template<class T>
+int emit(DFILE * f, print_specifier const & spec, T const & v) {
+  using U = std::remove_cv_t<std::decay_t<T>>;
+  constexpr arg_kind kind = kind_of<T>();
+  if constexpr(kind == arg_kind::boolean) {
+    return d_fprint_str_unlocked(f, &spec, v ? "true" : "false", v ? 4 : 5);
+  } else if constexpr(kind == arg_kind::sint || kind == arg_kind::chr) {
+    // like printf, unsigned conversions print the bits at the type's width
+    if(spec.print_kind == PRINT_INT || spec.print_kind == PRINT_CHAR)
+      return d_fprint_int_unlocked(f, &spec, v);
+    return d_fprint_uint_unlocked(f, &spec, static_cast<std::make_unsigned_t<U>>(v));
+  } else if constexpr(kind == arg_kind::uint) {
+    return d_fprint_uint_unlocked(f, &spec, v);
+  } else if constexpr(kind == arg_kind::f32 || kind == arg_kind::f64) {
+    using F = std::conditional_t<kind == arg_kind::f32, float, double>;
+    // only {} sets roundtrip on g
+    if(spec.print_kind == PRINT_GENERAL && (spec.flags & PRINT_ROUNDTRIP))
+      return emit_shortest<F>(f, spec, v);
+    if constexpr(kind == arg_kind::f32)
+      return d_fprint_float_unlocked(f, &spec, v);
+    else
+      return d_fprint_double_unlocked(f, &spec, v);
+  } else if constexpr(kind == arg_kind::str) {
+    std::string_view s = v;
+    return d_fprint_str_unlocked(f, &spec, s.data(), s.size());
+  } else {
+    return d_fprint_ptr_unlocked(f, &spec, static_cast<void const *>(v));
+  }
+}
+
+template<class Fmt, class... Args, size_t... I>
+int print_unlocked(DFILE * f, Fmt const & fmt, std::index_sequence<I...>, Args const &... args) {
+  int printed = write_literal(f, fmt.literals[0]);
+  if(printed < 0)
+    return -1;
+  auto step = [&](print_specifier const & spec, literal const & lit, auto const & arg) {
+    int ret = emit(f, spec, arg);
+    if(ret < 0)
+      return false;
+    printed += ret;
+    ret = write_literal(f, lit);
+    if(ret < 0)
+      return false;
+    printed += ret;
+    return true;
+  };
+  (void)step;
+  if(!(step(fmt.specs[I], fmt.literals[I + 1], args) && ...))
+    return -1;
+  return printed;
+}
+
+} // namespace detail
+
+template<class... Args>
+using format_string = detail::basic_format_string<std::type_identity_t<Args>...>;
+
+// returns the number of chars printed, or -1
+template<class... Args>
+int print(DFILE * f, format_string<Args...> fmt, Args const &... args) {
+  d_flockfile(f);
+  int ret = detail::print_unlocked(f, fmt, std::index_sequence_for<Args...>{}, args...);
+  d_funlockfile(f);
+  return ret;
+}
+template<class... Args>
+int print(format_string<Args...> fmt, Args const &... args) {
+  return print(dstdout, fmt, args...);
+}
+
+} // namespace d
+
+#endif
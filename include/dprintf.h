@@ -11,7 +11,9 @@ enum {
   PRINT_GENERAL, PRINT_HEXPONENT,
   PRINT_POINTER, PRINT_TELL,
   PRINT_ERROR, SCAN_SET,
-  PRINT_CUSTOM,
+  PRINT_CUSTOM, PRINT_SLICE,
+  PRINT_HEXBUF, PRINT_HEXDUMP, PRINT_BASE64, PRINT_JSON,
+  PRINT_TIME,
 
   SCAN_INCOMPLETE = PRINT_INCOMPLETE, SCAN_MALFORMED = PRINT_MALFORMED,
   SCAN_PERCENT = PRINT_PERCENT, SCAN_CHAR = PRINT_CHAR,
@@ -33,6 +35,8 @@ enum {
   PRINT_ROUNDTRIP = 64,
   SCAN_IGNORE = 128,
   SCAN_INVERTED = 256,
+  PRINT_WIDTH_ARG = 512,
+  PRINT_PRECISION_ARG = 1024,
 };
 
 enum {
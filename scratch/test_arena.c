@@ -0,0 +1,88 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include "dfile.h"
+
+// a bump allocator over a fixed block that counts its calls
+typedef struct bump {
+  char block[1 << 16];
+  size_t used;
+  int calls;
+} bump;
+
+static void * bump_alloc(void * cookie, size_t size) {
+  bump * b = cookie;
+  b->calls++;
+  if(size > sizeof b->block - b->used)
+    return NULL;
+  void * ret = b->block + b->used;
+  b->used += size;
+  return ret;
+}
+
+// an allocator that leaves errno changed, as malloc may
+static void * clobber_alloc(void * cookie, size_t size) {
+  errno = ENOMEM;
+  return bump_alloc(cookie, size);
+}
+
+int main() {
+  static bump b;
+  d_arena arena = { bump_alloc, &b };
+
+  {
+    char * s = d_asprintf_arena(&arena, "%s=%d", "answer", 42);
+    assert(s && !strcmp(s, "answer=42"));
+    assert(b.calls == 1 && b.used == 10);
+    assert(s == b.block);
+  }
+
+  {
+    // longer than the stack buffer it formats into first, so it's
+    // formatted a second time, still with one allocation
+    static char big[3000];
+    memset(big, 'y', sizeof big - 1);
+    size_t before = b.used;
+    b.calls = 0;
+    char * s = d_asprintf_arena(&arena, "<%s>", big);
+    assert(s && strlen(s) == sizeof big + 1);
+    assert(s[0] == '<' && s[sizeof big] == '>');
+    assert(b.calls == 1 && b.used - before == sizeof big + 2);
+  }
+
+  {
+    // %m on the second pass still sees the caller's errno, and the
+    // count is of what's in the string
+    d_arena clobber = { clobber_alloc, &b };
+    char pad[300];
+    memset(pad, '.', sizeof pad - 1);
+    pad[sizeof pad - 1] = '\0';
+    errno = ENOENT;
+    char * s = d_asprintf_arena(&clobber, "%s %m", pad);
+    char expect[512];
+    d_snprintf(expect, sizeof expect, "%s %s", pad, strerror(ENOENT));
+    assert(s && !strcmp(s, expect));
+    errno = EACCES;
+    char * m;
+    int n = d_asprintf(&m, "%s %m", pad);
+    d_snprintf(expect, sizeof expect, "%s %s", pad, strerror(EACCES));
+    assert(n == (int)strlen(m) && !strcmp(m, expect));
+    d_free(m);
+  }
+
+  {
+    // a failed allocation is a NULL result
+    b.used = sizeof b.block;
+    assert(!d_asprintf_arena(&arena, "%d", 1));
+    b.used = 0;
+  }
+
+  {
+    char * s;
+    assert(d_asprintf(&s, "%05.1f", 2.25) == 5);
+    assert(!strcmp(s, "002.2"));
+    d_free(s);
+  }
+  return 0;
+}
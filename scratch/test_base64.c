@@ -0,0 +1,118 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include "dfile.h"
+
+static char const digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// a byte at a time, to hold the 16 byte kernels to
+static int encode(char * dst, unsigned char const * src, int n) {
+  int len = 0;
+  for(int i = 0; i < n; i += 3) {
+    unsigned v = src[i] << 16 | (i + 1 < n ? src[i + 1] << 8 : 0) | (i + 2 < n ? src[i + 2] : 0);
+    dst[len++] = digits[v >> 18];
+    dst[len++] = digits[v >> 12 & 63];
+    dst[len++] = i + 1 < n ? digits[v >> 6 & 63] : '=';
+    dst[len++] = i + 2 < n ? digits[v & 63] : '=';
+  }
+  dst[len] = '\0';
+  return len;
+}
+
+int main() {
+  enum { N = 10000 };
+  unsigned char * data = malloc(N);
+  for(int i = 0; i < N; i++)
+    data[i] = i * 131 + (i >> 7);
+  char * expect = malloc(N * 2);
+  char * buf = malloc(N * 2);
+
+  {
+    // the width is the length, and without one it's a single byte
+    assert(d_snprintf(buf, 64, "[%pB][%*pB][%*pB]", "f", 3, "foo", 0, "") == 14);
+    assert(!strcmp(buf, "[Zg==][Zm9v][]"));
+    for(int n = 0; n < 100; n++) {
+      int len = encode(expect, data, n);
+      assert(d_snprintf(buf, N * 2, "%*pB", n, data) == len);
+      assert(!strcmp(buf, expect));
+    }
+    int len = encode(expect, data, N);
+    assert(d_snprintf(buf, N * 2, "%*pB", N, data) == len);
+    assert(!strcmp(buf, expect));
+  }
+
+  {
+    // decoding reads back what was encoded, in reads of any size
+    encode(expect, data, N);
+    DFILE * src = d_open_strstream(expect);
+    DFILE * f = d_open_base64stream(src);
+    int got = 0;
+    for(int step = 1; got < N; step = step % 37 + 1) {
+      int ret = d_fread(buf + got, step, f);
+      assert(ret > 0);
+      got += ret;
+    }
+    assert(got == N && !memcmp(buf, data, N));
+    assert(d_fread(buf, 1, f) == 0);
+    d_fclose(f);
+    d_fclose(src);
+  }
+
+  {
+    // MIME style lines of 76 digits decode the same
+    int len = encode(expect, data, N);
+    char * wrapped = malloc(len + len / 76 * 2 + 3);
+    int w = 0;
+    for(int i = 0; i < len; i += 76) {
+      int run = len - i < 76 ? len - i : 76;
+      memcpy(wrapped + w, expect + i, run);
+      w += run;
+      wrapped[w++] = '\r';
+      wrapped[w++] = '\n';
+    }
+    wrapped[w] = '\0';
+    DFILE * src = d_open_strstream(wrapped);
+    DFILE * f = d_open_base64stream(src);
+    int got = 0;
+    for(int step = 100; got < N; step = step % 3000 + 700) {
+      int ret = d_fread(buf + got, step, f);
+      assert(ret > 0);
+      got += ret;
+    }
+    assert(got == N && !memcmp(buf, data, N));
+    d_fclose(f);
+    d_fclose(src);
+    free(wrapped);
+  }
+
+  {
+    // whitespace is skipped and padding ends it, scanf works on top
+    DFILE * src = d_open_strstream("MTIz IDQ1\nNiBo\r\naQ==trailing");
+    DFILE * f = d_open_base64stream(src);
+    int a, b;
+    char word[8];
+    assert(d_fscanf(f, "%d %d %s", &a, &b, word) == 3);
+    assert(a == 123 && b == 456 && !strcmp(word, "hi"));
+    d_fclose(f);
+    d_fclose(src);
+  }
+
+  {
+    // a bad digit fails after what came before it, and keeps failing
+    DFILE * src = d_open_strstream("Zm9vYmFy*Zm9v");
+    DFILE * f = d_open_base64stream(src);
+    assert(d_fread(buf, 64, f) == 6 && !memcmp(buf, "foobar", 6));
+    errno = 0;
+    assert(d_fread(buf, 64, f) <= 0);
+    assert(errno == EILSEQ);
+    assert(d_fread(buf, 64, f) <= 0);
+    d_fclose(f);
+    d_fclose(src);
+  }
+
+  free(buf);
+  free(expect);
+  free(data);
+  return 0;
+}
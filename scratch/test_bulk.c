@@ -0,0 +1,72 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include "dfile.h"
+
+// the bulk printers print what a loop of d_fprintf calls would
+static char * bulk_f64(double const * arr, size_t n, char const * sep, char const * spec, int * ret) {
+  char * buf;
+  size_t len;
+  DFILE * f = d_open_memstream(&buf, &len);
+  *ret = d_fprint_f64s(f, arr, n, sep, spec);
+  assert(!d_fclose(f));
+  assert(*ret == (int)len);
+  return buf;
+}
+
+static char * loop_f64(double const * arr, size_t n, char const * sep, char const * spec) {
+  char * buf;
+  size_t len;
+  DFILE * f = d_open_memstream(&buf, &len);
+  for(size_t i = 0; i < n; i++) {
+    if(i)
+      d_fputs(sep, f);
+    d_fprintf(f, spec, arr[i]);
+  }
+  assert(!d_fclose(f));
+  return buf;
+}
+
+int main() {
+  {
+    double arr[1000];
+    for(int i = 0; i < 1000; i++)
+      arr[i] = (rand() - RAND_MAX / 2) / 1000.0;
+    static char const * const specs[] = { "%.3f", "%g", "%rg", "%10.2e", "%-8.1f", "%+f" };
+    for(size_t s = 0; s < sizeof specs / sizeof *specs; s++) {
+      int ret;
+      char * got = bulk_f64(arr, 1000, ", ", specs[s], &ret);
+      char * want = loop_f64(arr, 1000, ", ", specs[s]);
+      assert(!strcmp(got, want));
+      d_free(got);
+      d_free(want);
+    }
+  }
+
+  {
+    char buf[256];
+    DFILE * f = d_fmemopen(buf, sizeof buf, "w");
+    float fs[] = { 0.1f, 1.5f, -2.25f };
+    assert(d_fprint_f32s(f, fs, 3, " ", "%rg") == 13);
+    d_fputc('|', f);
+    int32_t is[] = { 1, -1, 255 };
+    assert(d_fprint_i32s(f, is, 3, ",", "%08x") == 26);
+    d_fputc('|', f);
+    int64_t ls[] = { 1, -1 };
+    assert(d_fprint_i64s(f, ls, 2, ",", "%llx") == 18);
+    d_fputc('|', f);
+    assert(d_fprint_i64s(f, ls, 0, ",", "%llx") == 0);
+    d_fputc('\0', f);
+    assert(!strcmp(buf, "0.1 1.5 -2.25|00000001,ffffffff,000000ff|1,ffffffffffffffff|"));
+    assert(!d_fclose(f));
+  }
+
+  {
+    // the spec has to be a single conversion
+    double d = 1;
+    assert(d_fprint_f64s(dstdout, &d, 1, ",", "%f%f") < 0);
+    assert(d_fprint_f64s(dstdout, &d, 1, ",", "x") < 0);
+  }
+  return 0;
+}
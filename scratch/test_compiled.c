@@ -0,0 +1,60 @@
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "dfile.h"
+
+// a compiled format prints exactly what the same format does uncompiled
+static void same(char const * fmt, char const * want, d_fmt const * prog, ...) {
+  char * buf;
+  size_t len;
+  DFILE * f = d_open_memstream(&buf, &len);
+  va_list args;
+  va_start(args, prog);
+  int ret = d_vfprintf_compiled(f, prog, args);
+  va_end(args);
+  assert(!d_fclose(f));
+  if(strcmp(buf, want) || ret != (int)len) {
+    d_fprintf(dstderr, "%s: got '%s' want '%s'\n", fmt, buf, want);
+    abort();
+  }
+  d_free(buf);
+}
+
+#define SAME(fmt, ...) do { \
+    char want[256]; \
+    d_snprintf(want, sizeof want, fmt, __VA_ARGS__); \
+    d_fmt * prog = d_fmt_compile(fmt); \
+    assert(prog); \
+    same(fmt, want, prog, __VA_ARGS__); \
+    d_fmt_free(prog); \
+  } while(0)
+
+int main() {
+  SAME("plain text%s", "");
+  SAME("%d %i %u %x %X %o %b", -12, 34, 56u, 0xbabe, 0xBAB3, 0776, 10);
+  SAME("[%10d] [%-10d] [%010d] [%+d] [% d]", 1, 2, 3, 4, 5);
+  SAME("%lld %llu %zu %hhu %hd", -1LL, ~0ULL, (size_t)7, 257, 65537);
+  SAME("%*d|%-*d|%.*f", 6, 1, 6, 2, 3, 3.14159);
+  SAME("%f %.2f %e %g %a %rg", 0.1, 1.995, 12345.678, 0.0001234, 1.75, 0.1 + 0.2);
+  SAME("%s|%10s|%-10s|%.3s", "str", "right", "left", "truncated");
+  SAME("%c%c %% %p", 'o', 'k', (void*)0x1234);
+  SAME("%w32u %w64d", (uint32_t)1, (int64_t)-2);
+
+  {
+    // %n stores the count like the uncompiled call
+    d_fmt * prog = d_fmt_compile("hello%n world");
+    int n = 0;
+    char * buf;
+    size_t len;
+    DFILE * f = d_open_memstream(&buf, &len);
+    d_fprintf_compiled(f, prog, &n);
+    assert(!d_fclose(f));
+    assert(n == 5 && !strcmp(buf, "hello world"));
+    d_free(buf);
+    d_fmt_free(prog);
+  }
+
+  assert(!d_fmt_compile("bad %"));
+  assert(!d_fmt_compile("bad %<label"));
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include "dfile.h"
+#include "dprintf.h"
+
+typedef struct point {
+  int x, y;
+} point;
+
+// %<point> takes a point *, and honors width and the - flag
+static int print_point(DFILE * f, struct print_specifier const * spec, va_list * args) {
+  point const * p = va_arg(*args, point const *);
+  char tmp[32];
+  int len = d_snprintf(tmp, sizeof tmp, "(%d, %d)", p->x, p->y);
+  int width = spec->field_width > len ? spec->field_width : len;
+  char * out = d_freserve_unlocked(f, width);
+  if(!out)
+    return -1;
+  int pad = width - len;
+  if(spec->flags & PRINT_LEFT_JUSTIFY) {
+    memcpy(out, tmp, len);
+    memset(out + len, ' ', pad);
+  } else {
+    memset(out, ' ', pad);
+    memcpy(out + pad, tmp, len);
+  }
+  return d_fcommit_unlocked(f, width);
+}
+
+static int print_upper(DFILE * f, struct print_specifier const * spec, va_list * args) {
+  (void)spec;
+  char const * s = va_arg(*args, char const *);
+  int n = 0;
+  for(; *s; s++, n++)
+    d_fputc_unlocked(*s >= 'a' && *s <= 'z' ? *s - 32 : *s, f);
+  return n;
+}
+
+int main() {
+  assert(!d_register_printf("point", print_point));
+  assert(!d_register_printf("upper", print_upper));
+
+  char buf[128];
+  point p = { 3, -4 };
+  assert(d_snprintf(buf, sizeof buf, "p=%<point> %d", &p, 5) == 11);
+  assert(!strcmp(buf, "p=(3, -4) 5"));
+  assert(d_snprintf(buf, sizeof buf, "[%12<point>][%-12<point>]", &p, &p) == 28);
+  assert(!strcmp(buf, "[     (3, -4)][(3, -4)     ]"));
+  assert(d_snprintf(buf, sizeof buf, "%<upper>, %<point>!", "hi there", &p) == 18);
+  assert(!strcmp(buf, "HI THERE, (3, -4)!"));
+
+  {
+    // the arguments after a custom conversion are still in step
+    assert(d_snprintf(buf, sizeof buf, "%<upper>%s%<upper>%d", "a", "b", "c", 7) == 4);
+    assert(!strcmp(buf, "AbC7"));
+  }
+
+  {
+    // re-registering replaces, and NULL unregisters
+    assert(!d_register_printf("upper", print_point));
+    assert(d_snprintf(buf, sizeof buf, "%<upper>", &p) == 7);
+    assert(d_register_printf("upper", NULL) == 0);
+    assert(d_snprintf(buf, sizeof buf, "%<upper>", &p) < 0);
+  }
+
+  {
+    errno = 0;
+    assert(d_register_printf("", print_point) < 0 && errno == EINVAL);
+    assert(d_register_printf("a>b", print_point) < 0 && errno == EINVAL);
+    assert(d_register_printf("0123456789012345678901234567890123", print_point) < 0);
+  }
+  return 0;
+}
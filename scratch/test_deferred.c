@@ -0,0 +1,127 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include "dfile.h"
+#include "dprintf.h"
+
+// renders what was logged to f and compares it to expect
+static void check(DFILE * f, int printfs, char const * expect) {
+  char * buf;
+  size_t len;
+  DFILE * out = d_open_memstream(&buf, &len);
+  assert(!d_fseek(f, 0, D_SEEK_SET));
+  assert(d_fdecode_deferred(f, out) == printfs);
+  d_fflush(out);
+  assert(len == strlen(expect) && !memcmp(buf, expect, len));
+  assert(!d_fclose(out));
+  d_free(buf);
+}
+
+// %<rep> prints its char argument count times, count being an int first
+static int print_rep(DFILE * f, struct print_specifier const * spec, va_list * args) {
+  (void)spec;
+  int count = va_arg(*args, int);
+  char c = va_arg(*args, int);
+  for(int i = 0; i < count; i++)
+    d_fputc_unlocked(c, f);
+  return count;
+}
+
+int main() {
+  {
+    // the second printf of a format only copies its arguments
+    DFILE * f = d_tmpfile();
+    assert(!d_fsetdeferred(f, 1));
+    for(int i = 0; i < 3; i++)
+      assert(d_fprintf(f, "%d %s %S|%5.2f\n", i, "str", "slice", (size_t)3, i / 4.0) == 0);
+    assert(d_fprintf(f, "just text\n") == 0);
+    check(f, 4, "0 str sli| 0.00\n1 str sli| 0.25\n2 str sli| 0.50\njust text\n");
+    d_fclose(f);
+  }
+
+  {
+    // plain writes in between records come out in order
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    assert(d_fprintf(f, "<%x>", 255) == 0);
+    assert(d_fputs("raw", f) == 3);
+    assert(d_fputc('!', f) == '!');
+    assert(d_fwrite("", 0, f) == 0);
+    assert(d_freserve_unlocked(f, 4) == NULL);
+    assert(d_fprintf(f, "<%*d>\n", 4, 7) == 0);
+    check(f, 2, "<ff>raw!<   7>\n");
+    d_fclose(f);
+  }
+
+  {
+    // %m is taken when the printf runs, and compiled formats log too
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    d_fmt * prog = d_fmt_compile("%s: %m %% %c\n");
+    errno = ENOENT;
+    assert(d_fprintf_compiled(f, prog, "open", 'x') == 0);
+    errno = 0;
+    assert(d_fprintf_compiled(f, prog, "again", 'y') == 0);
+    char expect[256];
+    d_snprintf(expect, sizeof expect, "open: %s %% x\nagain: %s %% y\n", strerror(ENOENT), strerror(0));
+    check(f, 2, expect);
+    d_fmt_free(prog);
+    d_fclose(f);
+  }
+
+  {
+    // a freed format's memory going to the next one doesn't make the
+    // stream think it already wrote the new one's text
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    for(int i = 0; i < 4; i++) {
+      d_fmt * a = d_fmt_compile("A=%d\n");
+      assert(d_fprintf_compiled(f, a, i) == 0);
+      d_fmt_free(a);
+      d_fmt * b = d_fmt_compile("B=%s\n");
+      assert(d_fprintf_compiled(f, b, "s") == 0);
+      d_fmt_free(b);
+    }
+    check(f, 8, "A=0\nB=s\nA=1\nB=s\nA=2\nB=s\nA=3\nB=s\n");
+    d_fclose(f);
+  }
+
+  {
+    // a label's output is kept whole however long it is, and the
+    // arguments after it still line up
+    assert(!d_register_printf("rep", print_rep));
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    assert(d_fprintf(f, "[%<rep>|%d]\n", 3, 'a', 1) == 0);
+    assert(d_fprintf(f, "[%<rep>|%d]\n", 5000, 'b', 2) == 0);
+    char * expect = malloc(6000);
+    int n = d_snprintf(expect, 6000, "[%<rep>|%d]\n[%<rep>|%d]\n", 3, 'a', 1, 5000, 'b', 2);
+    assert(n == 5013);
+    check(f, 2, expect);
+    free(expect);
+    d_fclose(f);
+  }
+
+  {
+    // turning deferral off and on again writes the formats again
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    d_fprintf(f, "%d,", 1);
+    assert(d_fsetdeferred(f, 0) == 1);
+    assert(d_fsetdeferred(f, 1) == 0);
+    d_fprintf(f, "%d,", 2);
+    check(f, 2, "1,2,");
+    d_fclose(f);
+  }
+
+  {
+    // a malformed format logs nothing
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    assert(d_fprintf(f, "%y") == -1);
+    check(f, 0, "");
+    d_fclose(f);
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "dfile.h"
+
+// fixed precisions print the exact decimal value rounded half to even,
+// which is what glibc prints too
+static void check(char const * fmt, double d) {
+  char want[2048], got[2048];
+  int want_len = snprintf(want, sizeof want, fmt, d);
+  int got_len = d_snprintf(got, sizeof got, fmt, d);
+  if(want_len != got_len || strcmp(want, got)) {
+    fprintf(stderr, "%s of %a: got '%s' want '%s'\n", fmt, d, got, want);
+    abort();
+  }
+}
+
+static double random_double(void) {
+  uint64_t bits = 0;
+  for(int i = 0; i < 4; i++)
+    bits = bits << 16 | (rand() & 0xffff);
+  double d;
+  memcpy(&d, &bits, sizeof d);
+  return d;
+}
+
+int main() {
+  static double const cases[] = {
+    0.0, -0.0, 1.995, 1.985, 2.5, 3.5, -2.5, 0.125, 0.1, 0.3, 1e-300,
+    4.9406564584124654e-324, 2.2250738585072014e-308, 1.7976931348623157e308,
+    9.5, 99.5, 999.9999999, 0.05, 0.005, 123456789.125, 1e22, 1e23,
+  };
+  static char const * const fmts[] = {
+    "%.0f", "%.1f", "%.2f", "%.3f", "%.6f", "%.10f", "%.17f", "%.20f",
+    "%.40f", "%.0e", "%.2e", "%.6e", "%.16e", "%.30e", "%#.0f", "%#.0e",
+  };
+  for(size_t i = 0; i < sizeof cases / sizeof *cases; i++)
+    for(size_t j = 0; j < sizeof fmts / sizeof *fmts; j++)
+      check(fmts[j], cases[i]);
+
+  srand(35);
+  char fmt[16];
+  for(int i = 0; i < 20000; i++) {
+    double d = random_double();
+    // skip nan and infinity
+    if(d - d != 0)
+      continue;
+    // scale most of them into a range where the digits matter
+    if(i % 4)
+      d = d / (d < 0 ? -d : d) * ((rand() % 1000000) / 1000.0);
+    snprintf(fmt, sizeof fmt, "%%.%d%c", rand() % 25, i & 1 ? 'f' : 'e');
+    check(fmt, d);
+  }
+  return 0;
+}
@@ -0,0 +1,100 @@
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/stat.h>
+#include "dfile.h"
+
+enum { BIG = 5000 };
+
+// how much of f has reached the file
+static long written(DFILE * f) {
+  struct stat st;
+  assert(!fstat(d_fileno(f), &st));
+  return st.st_size;
+}
+
+// reads back everything written to f
+static char * slurp(DFILE * f, int * len) {
+  d_fflush(f);
+  assert(!d_fseek(f, 0, D_SEEK_SET));
+  char * buf = malloc(1 << 20);
+  *len = d_fread(buf, 1 << 20, f);
+  return buf;
+}
+
+int main() {
+  char * big = malloc(BIG + 1);
+  for(int i = 0; i < BIG; i++)
+    big[i] = 'a' + i % 26;
+  big[BIG] = '\0';
+  char * expect = malloc(1 << 20);
+
+  {
+    // big strings go out by reference, around the buffered bytes
+    DFILE * f = d_tmpfile();
+    int n = d_fprintf(f, "<%s|%d|%s>", big, 42, big);
+    assert(n == 2 * BIG + 6);
+    int elen = d_snprintf(expect, 1 << 20, "<%s|%d|%s>", big, 42, big);
+    int len;
+    char * got = slurp(f, &len);
+    assert(len == elen && !memcmp(got, expect, len));
+    free(got);
+    d_fclose(f);
+  }
+
+  {
+    // more pieces than one writev queues, a big literal, padding, and
+    // bytes already in the buffer from before the printf
+    DFILE * f = d_tmpfile();
+    char * fmt = malloc(BIG + 64);
+    memcpy(fmt, big, BIG);
+    strcpy(fmt + BIG, "%s%s%s%s%s%s%s%s%s%s|%6000s|%.2000s%c");
+    d_fputs("head ", f);
+    int n = d_fprintf(f, fmt, big, big, big, big, big, big, big, big, big, big, "x", big, '!');
+    int elen = d_snprintf(expect, 1 << 20, "head ");
+    elen += d_snprintf(expect + elen, (1 << 20) - elen, fmt, big, big, big, big, big, big, big, big, big, big, "x", big, '!');
+    assert(n == elen - 5);
+    d_fputs(" tail", f);
+    memcpy(expect + elen, " tail", 5);
+    elen += 5;
+    int len;
+    char * got = slurp(f, &len);
+    assert(len == elen && !memcmp(got, expect, len));
+    free(got);
+    free(fmt);
+    d_fclose(f);
+  }
+
+  {
+    // line buffered streams don't gather, and still get it all
+    DFILE * f = d_tmpfile();
+    d_setvbuf(f, NULL, D_IOLBF, 0);
+    d_fprintf(f, "%s\n%s", big, big);
+    int elen = d_snprintf(expect, 1 << 20, "%s\n%s", big, big);
+    int len;
+    char * got = slurp(f, &len);
+    assert(len == elen && !memcmp(got, expect, len));
+    free(got);
+    d_fclose(f);
+  }
+
+  {
+    // pieces that fit in the buffer are copied, so printfs keep
+    // buffering, and only one that doesn't fit goes out with a writev
+    DFILE * f = d_tmpfile();
+    char mid[1100];
+    memset(mid, 'm', sizeof mid - 1);
+    mid[sizeof mid - 1] = '\0';
+    int total = 0;
+    for(int i = 0; i < 3; i++)
+      total += d_fprintf(f, "%d %s\n", i, mid);
+    assert(written(f) == 0);
+    total += d_fprintf(f, "%s", big);
+    assert(written(f) == total);
+    d_fclose(f);
+  }
+
+  free(expect);
+  free(big);
+  return 0;
+}
@@ -0,0 +1,64 @@
+#include <string.h>
+#include <assert.h>
+#include "dfile.h"
+
+int main() {
+  unsigned char b[40];
+  for(int i = 0; i < 40; i++)
+    b[i] = i * 7 + 30;
+  char buf[512];
+
+  {
+    // the width is the length, and without one it's a single byte
+    assert(d_snprintf(buf, sizeof buf, "[%pH][%4pH][%*pH][%*pH]", b, b, 3, b, -2, b) == 24);
+    assert(!strcmp(buf, "[1e][1e252c33][1e252c][]"));
+    assert(d_snprintf(buf, sizeof buf, "%*pH", 0, NULL) == 0);
+  }
+
+  {
+    // xxd's layout, a partial last line padded out to the text column
+    d_snprintf(buf, sizeof buf, "%*pD", 20, b);
+    assert(!strcmp(buf,
+      "00000000: 1e25 2c33 3a41 484f 565d 646b 7279 8087  .%,3:AHOV]dkry..\n"
+      "00000010: 8e95 9ca3                                ....\n"));
+    d_snprintf(buf, sizeof buf, "%pD", b);
+    assert(!strcmp(buf, "00000000: 1e                                       .\n"));
+  }
+
+  {
+    // longer than the 16 byte kernel, against %02x
+    char expect[128];
+    int n = 0;
+    for(int i = 0; i < 40; i++)
+      n += d_snprintf(expect + n, sizeof expect - n, "%02x", b[i]);
+    assert(d_snprintf(buf, sizeof buf, "%*pH", 40, b) == 80);
+    assert(!strcmp(buf, expect));
+  }
+
+  {
+    // compiled and deferred formats take the same defaults
+    char * out;
+    size_t len;
+    DFILE * o = d_open_memstream(&out, &len);
+    d_fmt * prog = d_fmt_compile("%pH %pD");
+    d_fprintf_compiled(o, prog, b, b + 1);
+    d_fflush(o);
+    assert(!strcmp(out, "1e 00000000: 25                                       %\n"));
+    d_fmt_free(prog);
+    d_fclose(o);
+    d_free(out);
+
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    assert(d_fprintf(f, "%pH|%*pH|%pD", b, 2, b, b) == 0);
+    o = d_open_memstream(&out, &len);
+    d_fseek(f, 0, D_SEEK_SET);
+    assert(d_fdecode_deferred(f, o) == 1);
+    d_fflush(o);
+    assert(!strcmp(out, "1e|1e25|00000000: 1e                                       .\n"));
+    d_fclose(o);
+    d_free(out);
+    d_fclose(f);
+  }
+  return 0;
+}
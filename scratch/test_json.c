@@ -0,0 +1,105 @@
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "dfile.h"
+
+// one character at a time, to hold the 16 byte scan to
+static int escape(char * dst, char const * src, size_t len) {
+  int n = 0;
+  dst[n++] = '"';
+  for(size_t i = 0; i < len; i++) {
+    unsigned char c = src[i];
+    if(c == '"' || c == '\\') {
+      dst[n++] = '\\';
+      dst[n++] = c;
+    } else if(c == '\n') {
+      dst[n++] = '\\';
+      dst[n++] = 'n';
+    } else if(c == '\t') {
+      dst[n++] = '\\';
+      dst[n++] = 't';
+    } else if(c == '\r') {
+      dst[n++] = '\\';
+      dst[n++] = 'r';
+    } else if(c == '\b') {
+      dst[n++] = '\\';
+      dst[n++] = 'b';
+    } else if(c == '\f') {
+      dst[n++] = '\\';
+      dst[n++] = 'f';
+    } else if(c < 0x20) {
+      n += d_snprintf(dst + n, 7, "\\u%04x", c);
+    } else {
+      dst[n++] = c;
+    }
+  }
+  dst[n++] = '"';
+  dst[n] = '\0';
+  return n;
+}
+
+int main() {
+  char buf[256];
+
+  {
+    // quotes, backslashes and control characters are escaped, the
+    // rest, utf-8 included, passes through
+    char const * s = "a\"b\\c\n\t\x01\x1f/\x7f\xc3\xa9";
+    assert(d_snprintf(buf, sizeof buf, "[%<json>]", s) == 31);
+    assert(!strcmp(buf, "[\"a\\\"b\\\\c\\n\\t\\u0001\\u001f/\x7f\xc3\xa9\"]"));
+  }
+
+  {
+    // NULL is null, and the precision caps the bytes read
+    assert(d_snprintf(buf, sizeof buf, "%<json> %.3<json> %<json>", (char *)NULL, "abcdef", "") == 13);
+    assert(!strcmp(buf, "null \"abc\" \"\""));
+  }
+
+  {
+    // every byte value but nul, at every offset around the 16 byte blocks
+    enum { N = 300 };
+    char * src = malloc(N);
+    char * expect = malloc(8 * N);
+    char * got = malloc(8 * N);
+    for(int i = 0; i < N; i++)
+      src[i] = (char)(i * 37 + 1) ? i * 37 + 1 : 1;
+    for(int off = 0; off < 40; off++) {
+      int len = escape(expect, src + off, N - off);
+      assert(d_snprintf(got, 8 * N, "%.*<json>", N - off, src + off) == len);
+      assert(!strcmp(got, expect));
+    }
+    free(got);
+    free(expect);
+    free(src);
+  }
+
+  {
+    // d_fput_json_string takes a length, so nuls are escaped too
+    char * out;
+    size_t len;
+    DFILE * f = d_open_memstream(&out, &len);
+    assert(d_fput_json_string("x\0y", 3, f) == 10);
+    d_fflush(f);
+    assert(!strcmp(out, "\"x\\u0000y\""));
+    d_fclose(f);
+    d_free(out);
+  }
+
+  {
+    // deferred streams keep NULL apart from the empty string
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    assert(d_fprintf(f, "%<json>,%<json>,%<json>", (char *)NULL, "", "q\"") == 0);
+    char * out;
+    size_t len;
+    DFILE * o = d_open_memstream(&out, &len);
+    d_fseek(f, 0, D_SEEK_SET);
+    assert(d_fdecode_deferred(f, o) == 1);
+    d_fflush(o);
+    assert(!strcmp(out, "null,\"\",\"q\\\"\""));
+    d_fclose(o);
+    d_free(out);
+    d_fclose(f);
+  }
+  return 0;
+}
@@ -0,0 +1,82 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include "dfile.h"
+
+int main() {
+  int fds[2];
+  assert(!pipe(fds));
+  DFILE * w = d_fdopen(fds[1], "wn");
+  DFILE * r = d_fdopen(fds[0], "rn");
+  char buf[8192];
+  memset(buf, 'x', sizeof buf);
+
+  {
+    // nothing to read yet is EAGAIN, not eof or an error
+    errno = 0;
+    assert(d_fread(buf, 10, r) == -1);
+    assert(errno == EAGAIN);
+    assert(!d_feof(r) && !d_ferror(r));
+  }
+
+  {
+    // writes take what fits until the pipe and the buffer are full
+    long written = 0;
+    int n;
+    for(int i = 0; i < 100; i++) {
+      n = d_fwrite(buf, sizeof buf, w);
+      if(n < 0)
+        break;
+      written += n;
+    }
+    assert(n == -1 && errno == EAGAIN);
+    assert(!d_ferror(w));
+    assert(d_fpending_write(w) > 0);
+
+    long got = 0;
+    while(written > got) {
+      while((n = d_fread(buf, sizeof buf, r)) > 0)
+        got += n;
+      if(d_fpending_write(w))
+        d_fflush(w);
+    }
+    assert(got == written);
+    assert(!d_fpending_write(w));
+    assert(!d_fbuffered_read(r));
+  }
+
+  {
+    // a short write leaves the rest in the buffer for the reader
+    assert(d_fwrite("hello\nworld\n", 12, w) == 12);
+    assert(!d_fflush(w));
+    char line[16];
+    assert(d_fgets(line, sizeof line, r));
+    assert(!strcmp(line, "hello\n"));
+    assert(d_fbuffered_read(r) == 6);
+    assert(d_fgets(line, sizeof line, r));
+    assert(!strcmp(line, "world\n"));
+  }
+
+  {
+    // d_fopen with n opens nonblocking, so a fifo without a writer
+    // doesn't hang the open
+    char path[64];
+    d_snprintf(path, sizeof path, "/tmp/test_nonblock.%d", (int)getpid());
+    assert(!mkfifo(path, 0600));
+    DFILE * f = d_fopen(path, "rn");
+    unlink(path);
+    assert(f);
+    assert(fcntl(d_fileno(f), F_GETFL) & O_NONBLOCK);
+    assert(d_fread(buf, 10, f) == 0);
+    assert(!d_fclose(f));
+  }
+
+  assert(!d_fclose(w));
+  assert(d_fread(buf, sizeof buf, r) == 0);
+  assert(d_feof(r));
+  assert(!d_fclose(r));
+  return 0;
+}
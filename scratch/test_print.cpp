@@ -0,0 +1,66 @@
+#include <cassert>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "dfile.hpp"
+
+// prints into a memstream and compares with want
+template<typename... Args>
+static void expect(char const * want, d::format_string<Args...> fmt, Args const &... args) {
+  char * buf;
+  size_t len;
+  DFILE * f = d_open_memstream(&buf, &len);
+  int ret = d::print(f, fmt, args...);
+  assert(!d_fclose(f));
+  if(std::strcmp(buf, want) || ret != (int)len) {
+    d_fprintf(dstderr, "got '%s' want '%s'\n", buf, want);
+    assert(false);
+  }
+  d_free(buf);
+}
+
+int main() {
+  expect("plain {braces}", "plain {{braces}}");
+  expect("x=1 y=-2 z=3", "x={} y={} z={}", 1, -2, 3u);
+  expect("0.1 0.30000000000000004 1.5", "{} {} {}", 0.1, 0.1 + 0.2, 1.5f);
+  // the shorter of fixed and scientific, fixed on a tie, as std::format
+  expect("123456789 1e+20 1e-04 0.001 123456 1.5e+300 -0 1e+10 3e-05", "{} {} {} {} {} {} {} {} {}",
+         123456789.0, 1e20, 1e-4, 0.001, 123456.0, 1.5e300, -0.0, 1e10f, 3e-5f);
+  expect("   123456789|1e+20   |+2.5", "{:>12}|{:<8}|{:+}", 123456789.0, 1e20, 2.5);
+  for(int i = -320; i <= 320; i++) {
+    // against std::to_chars across the exponents, doubles and floats
+    for(double d : { std::pow(10.0, i), 1.2345678901234567 * std::pow(10.0, i) }) {
+      char want[64];
+      *std::to_chars(want, want + sizeof want, d).ptr = '\0';
+      expect(want, "{}", d);
+    }
+    if(i < -45 || i > 38)
+      continue;
+    for(float d : { std::pow(10.0f, (float)i), 1.2345678f * std::pow(10.0f, (float)i) }) {
+      char want[64];
+      *std::to_chars(want, want + sizeof want, d).ptr = '\0';
+      expect(want, "{}", d);
+    }
+  }
+  expect("3.142|3.14e+00|    2a|2A|0x2a|101", "{:.3f}|{:.2e}|{:6x}|{:X}|{:#x}|{:b}", 3.14159, 3.14159, 42, 42, 42, 5);
+  expect("+5|00042|-7   |   -7", "{:+}|{:05}|{:<5}|{:>5}", 5, 42, -7, -7);
+  expect("str|ab   |   ab|c", "{}|{:5}|{:>5}|{}", "str", std::string("ab"), std::string_view("ab"), 'c');
+  expect("ab|abc", "{:.2}|{:s}", "abcdef", "abc");
+  expect("true 1", "{} {}", true, (signed char)1);
+  expect("18446744073709551615 -9223372036854775808", "{} {}", ~0ULL, (long long)(-9223372036854775807LL - 1));
+  expect("(nil) 0x10", "{} {}", (void*)0, (void*)16);
+
+  {
+    // d::print to dstdout goes through the same path
+    char * buf;
+    size_t len;
+    DFILE * f = d_open_memstream(&buf, &len);
+    assert(d::print(f, "{} {}!\n", "hello", 42) == 10);
+    assert(!d_fclose(f));
+    assert(!std::strcmp(buf, "hello 42!\n"));
+    d_free(buf);
+  }
+  return 0;
+}
@@ -0,0 +1,26 @@
+#include <string.h>
+#include <assert.h>
+#include "dfile.h"
+
+int main() {
+  assert(d_printf_len("") == 0);
+  assert(d_printf_len("hello") == 5);
+  assert(d_printf_len("%d %s", -123, "abc") == 8);
+  assert(d_printf_len("%10.3f|%-*d|", 3.14159, 7, 1) == 19);
+  assert(d_printf_len("%rg", 0.1 + 0.2) == 19);
+  {
+    // agrees with what d_snprintf writes, for output past a buffer
+    static char big[20000];
+    memset(big, 'x', sizeof big - 1);
+    static char out[20100];
+    assert(d_printf_len("%s%5d", big, 1) == d_snprintf(out, sizeof out, "%s%5d", big, 1));
+    assert(d_printf_len("%s%5d", big, 1) == (int)strlen(out));
+  }
+  {
+    // %n still sees the count, and nothing is printed
+    int n = -1;
+    assert(d_printf_len("abc%ndef", &n) == 6);
+    assert(n == 3);
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include "dfile.h"
+
+int main() {
+  char * buf;
+  size_t len;
+  DFILE * f = d_open_memstream(&buf, &len);
+
+  {
+    // each emitter prints what its printf conversion would
+    assert(d_fput_i64(INT64_MIN, f) == 20);
+    d_fputc(' ', f);
+    assert(d_fput_u64(UINT64_MAX, f) == 20);
+    d_fputc(' ', f);
+    assert(d_fput_f64(0.1 + 0.2, f) == 19);
+    d_fputc(' ', f);
+    assert(d_fput_f32(0.1f, f) == 3);
+    d_fputc(' ', f);
+    assert(d_fput_str("str", f) == 3);
+    d_fflush(f);
+    assert(!strcmp(buf, "-9223372036854775808 18446744073709551615 0.30000000000000004 0.1 str"));
+  }
+
+  {
+    assert(!d_fclose(f));
+    d_free(buf);
+    f = d_open_memstream(&buf, &len);
+    char c = 'c';
+    unsigned char uc = 200;
+    short s = -3;
+    long double ld = 2.5;
+    char const * cs = "cs";
+    _Bool b = 1;
+    d_print(f, c, uc, s, ld, cs, b, 7u, -8L, 9ULL, 1.5f, "\n");
+    d_fflush(f);
+    assert(!strcmp(buf, "c200-32.5cs17-891.5\n"));
+  }
+
+  {
+    // sixteen values, which four labeled pairs and their separators need
+    assert(!d_fclose(f));
+    d_free(buf);
+    f = d_open_memstream(&buf, &len);
+    int a = 1, b = 2, c = 3, d = 4;
+    double x = 0.5, y = -0.25;
+    d_print(f, "a=", a, " b=", b, " c=", c, " d=", d, " x=", x, " y=", y, " z=", 7, " w", (char)'\n');
+    d_fflush(f);
+    assert(!strcmp(buf, "a=1 b=2 c=3 d=4 x=0.5 y=-0.25 z=7 w\n"));
+  }
+
+  assert(!d_fclose(f));
+  d_free(buf);
+  return 0;
+}
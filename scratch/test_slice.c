@@ -0,0 +1,56 @@
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include "dfile.h"
+
+int main() {
+  char buf[64];
+
+  {
+    // a slice needs no nul, and may hold one
+    assert(d_snprintf(buf, sizeof buf, "[%S]", "abcdef", (size_t)3) == 5);
+    assert(!strcmp(buf, "[abc]"));
+    assert(d_snprintf(buf, sizeof buf, "[%S]", "a\0b", (size_t)3) == 5);
+    assert(!memcmp(buf, "[a\0b]", 6));
+    assert(d_snprintf(buf, sizeof buf, "[%6S|%-6S]", "abc", (size_t)3, "de", (size_t)2) == 15);
+    assert(!strcmp(buf, "[   abc|de    ]"));
+  }
+
+  {
+    // the precision caps the slice, however long it claims to be
+    char const * str = "abcdef";
+    assert(d_snprintf(buf, sizeof buf, "[%.2S]", str, SIZE_MAX) == 4);
+    assert(!strcmp(buf, "[ab]"));
+    assert(d_snprintf(buf, sizeof buf, "[%.*S]", 4, str, (size_t)1 << 32) == 6);
+    assert(!strcmp(buf, "[abcd]"));
+  }
+
+  {
+    // a length past INT_MAX isn't cut down to its low bits
+    errno = 0;
+    assert(d_snprintf(buf, sizeof buf, "%S", "abc", ((size_t)1 << 32) + 3) == -1);
+    assert(errno == EOVERFLOW);
+    assert(d_printf_len("%S", "abc", (size_t)INT_MAX + 1) == -1);
+  }
+
+  {
+    // the same on a deferred stream, which keeps 32 bit lengths
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    assert(d_fprintf(f, "%S", "abc", ((size_t)1 << 32) + 3) == -1);
+    assert(d_fprintf(f, "%.1S\n", "abc", ((size_t)1 << 32) + 3) == 0);
+    char * out;
+    size_t len;
+    DFILE * o = d_open_memstream(&out, &len);
+    d_fseek(f, 0, D_SEEK_SET);
+    assert(d_fdecode_deferred(f, o) == 1);
+    d_fflush(o);
+    assert(!strcmp(out, "a\n"));
+    d_fclose(o);
+    d_free(out);
+    d_fclose(f);
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include "dfile.h"
+
+static int reserved;
+
+// formats its int argument in place when the sink has room, locking the
+// stream the way a printer shared with real streams would
+static int print_tag(DFILE * f, struct print_specifier const * spec, va_list * args) {
+  (void)spec;
+  int v = va_arg(*args, int);
+  d_flockfile(f);
+  char tmp[16];
+  int len = d_snprintf(tmp, sizeof tmp, "<%d>", v);
+  char * out = d_freserve_unlocked(f, len);
+  int ret;
+  if(out) {
+    reserved++;
+    memcpy(out, tmp, len);
+    ret = d_fcommit_unlocked(f, len);
+  } else {
+    ret = d_fwrite_unlocked(tmp, len, f);
+  }
+  d_funlockfile(f);
+  return ret;
+}
+
+int main() {
+  {
+    char buf[8];
+    memset(buf, 'z', sizeof buf);
+    assert(d_snprintf(buf, sizeof buf, "%s", "Hello, World") == 12);
+    assert(!strcmp(buf, "Hello, "));
+    assert(d_snprintf(buf, 1, "%d", 12345) == 5);
+    assert(buf[0] == '\0');
+    assert(d_snprintf(NULL, 0, "%d %s", 12345, "abc") == 9);
+    assert(d_snprintf(buf, sizeof buf, "%7d", 42) == 7);
+    assert(!strcmp(buf, "     42"));
+    // a conversion that straddles the end is cut at the byte
+    assert(d_snprintf(buf, sizeof buf, "ab%10.3f", 1.0) == 12);
+    assert(!strcmp(buf, "ab     "));
+  }
+
+  {
+    // d_sprintf has no limit, and longer output than a stream buffer
+    // comes out whole
+    static char big[100000], out[100100];
+    memset(big, 'q', sizeof big - 1);
+    assert(d_sprintf(out, "[%s]", big) == (int)sizeof big + 1);
+    assert(out[0] == '[' && out[sizeof big] == ']' && !out[sizeof big + 1]);
+    assert(strspn(out + 1, "q") == sizeof big - 1);
+    assert(d_sprintf(out, "%5000d%-3000x|", -7, 0xab) == 8001);
+    assert(out[4997] == ' ' && out[4998] == '-' && out[4999] == '7');
+    assert(out[5000] == 'a' && out[5001] == 'b' && out[5002] == ' ');
+    assert(out[8000] == '|' && !out[8001]);
+  }
+
+  {
+    assert(!d_register_printf("tag", print_tag));
+    char buf[64];
+    // unbounded, so the printer can reserve room in place
+    reserved = 0;
+    assert(d_sprintf(buf, "a%<tag>b%<tag>", 1, 22) == 9);
+    assert(!strcmp(buf, "a<1>b<22>"));
+    assert(reserved == 2);
+    // bounded, and near the end it has to fall back to writing
+    assert(d_snprintf(buf, 6, "a%<tag>b%<tag>", 1, 22) == 9);
+    assert(!strcmp(buf, "a<1>b"));
+    assert(d_register_printf("tag", NULL) == 0);
+  }
+  return 0;
+}
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+#include "dfile.h"
+
+// checks str is an ISO 8601 time with digits fraction digits within a
+// couple seconds of now, and returns the rest after the seconds
+static char const * check_time(char const * str, int digits, bool local) {
+  struct tm tm = { 0 };
+  int n = 0;
+  assert(d_sscanf(str, "%4d-%2d-%2dT%2d:%2d:%2d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &n) == 6 && n == 19);
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  str += n;
+  if(digits) {
+    assert(*str++ == '.');
+    for(int i = 0; i < digits; i++)
+      assert(*str >= '0' && *str <= '9'), str++;
+  }
+  assert(*str < '0' || *str > '9');
+  time_t now = time(NULL);
+  long offset = 0;
+  if(local) {
+    struct tm ltm;
+    localtime_r(&now, &ltm);
+    offset = ltm.tm_gmtoff;
+    char sign = offset < 0 ? '-' : '+';
+    long a = labs(offset);
+    char expect[8];
+    d_snprintf(expect, sizeof expect, "%c%02ld:%02ld", sign, a / 3600, a / 60 % 60);
+    assert(!strncmp(str, expect, 6));
+    str += 6;
+  } else {
+    assert(*str++ == 'Z');
+  }
+  time_t t = timegm(&tm) - offset;
+  assert(t <= now && now - t <= 2);
+  return str;
+}
+
+int main() {
+  char buf[256];
+
+  {
+    // utc by default with milliseconds, precision picks the digits
+    d_snprintf(buf, sizeof buf, "[%<time>]");
+    assert(*check_time(buf + 1, 3, false) == ']');
+    d_snprintf(buf, sizeof buf, "%.0<time>|%.9<time>|%.12<time>");
+    char const * rest = check_time(buf, 0, false);
+    rest = check_time(rest + 1, 9, false);
+    assert(*check_time(rest + 1, 9, false) == '\0');
+  }
+
+  {
+    // # is local time with its offset, here a half hour one. the text
+    // is cached for the second, so TZ is set before the first use
+    setenv("TZ", "Asia/Kolkata", 1);
+    tzset();
+    d_snprintf(buf, sizeof buf, "%#<time>");
+    assert(*check_time(buf, 3, true) == '\0');
+    assert(!strcmp(buf + 23, "+05:30"));
+  }
+
+  {
+    // width and - justify it
+    assert(d_snprintf(buf, sizeof buf, "[%30<time>]") == 32);
+    assert(!strncmp(buf, "[      ", 7));
+    assert(d_snprintf(buf, sizeof buf, "[%-26<time>]") == 28);
+    assert(!strcmp(buf + 25, "  ]"));
+  }
+
+  {
+    // the coarse clock, where there is one, still reads as now
+    int prev = d_settimecoarse(1);
+    if(prev >= 0) {
+      assert(prev == 0);
+      d_snprintf(buf, sizeof buf, "%<time>");
+      assert(*check_time(buf, 3, false) == '\0');
+      assert(d_settimecoarse(0) == 1);
+    }
+  }
+
+  {
+    // deferred streams record the time when the line is logged
+    DFILE * f = d_tmpfile();
+    d_fsetdeferred(f, 1);
+    assert(d_fprintf(f, "%.6<time> %d\n", 7) == 0);
+    char * out;
+    size_t len;
+    DFILE * o = d_open_memstream(&out, &len);
+    d_fseek(f, 0, D_SEEK_SET);
+    assert(d_fdecode_deferred(f, o) == 1);
+    d_fflush(o);
+    assert(!strcmp(check_time(out, 6, false), " 7\n"));
+    d_fclose(o);
+    d_free(out);
+    d_fclose(f);
+  }
+  return 0;
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright 2025 Richard N Van Natta
+ *
+ * This file is part of the DFILE stdio alternative.
+ *
+ * DFILE is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 2.1 of the
+ * License, or (at your option) any later version.
+ * 
+ * DFILE is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General
+ * Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with DFILE.
+ *
+ * If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "dfile.h"
+
+// base64 for printf's %*pB and the d_open_base64stream read adapter.
+// x86-64 only guarantees sse2, which has no byte shuffle, so the 16
+// byte kernels are compiled for ssse3 and picked at runtime
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAVE_SSSE3_KERNELS
+#include <tmmintrin.h>
+#endif
+
+static char const base64_digits[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// 0-63 for digits, PAD for '=', SPACE for whitespace, else BAD
+enum { B64_PAD = 64, B64_SPACE = 65, B64_BAD = 66 };
+static unsigned char const base64_values[256] = {
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 65, 65, 66, 66, 65, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+  65, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 62, 66, 66, 66, 63,
+  52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 66, 66, 66, 64, 66, 66,
+  66,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 66, 66, 66, 66, 66,
+  66, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+  41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, 66, 66, 66, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+  66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66, 66,
+};
+
+#ifdef HAVE_SSSE3_KERNELS
+static bool has_ssse3(void) {
+  static int cached = -1;
+  if(cached < 0) {
+    __builtin_cpu_init();
+    cached = __builtin_cpu_supports("ssse3");
+  }
+  return cached;
+}
+
+// 12 bytes to 16 digits per step, reading 16. returns the input consumed
+__attribute__((target("ssse3")))
+static size_t base64_encode_ssse3(char * dst, unsigned char const * src, size_t n) {
+  size_t done = 0;
+  __m128i const spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  __m128i const shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                      '/' - 63, 'A', 0, 0);
+  for(; n - done >= 16; done += 12, dst += 16) {
+    __m128i in = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(src + done)), spread);
+    // pull the four 6 bit fields of each 3 bytes into their own bytes
+    __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    __m128i indices = _mm_or_si128(t1, t3);
+    // then offset each into its range of the alphabet
+    __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+    __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+    range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+    __m128i out = _mm_add_epi8(_mm_shuffle_epi8(shift, range), indices);
+    _mm_storeu_si128((__m128i *)dst, out);
+  }
+  return done;
+}
+
+// 16 digits to 12 bytes per step, writing 16. stops at the first block
+// with anything but digits in it. returns the input consumed
+__attribute__((target("ssse3")))
+static size_t base64_decode_ssse3(unsigned char * dst, char const * src, size_t n) {
+  size_t done = 0;
+  __m128i const lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+  __m128i const lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  __m128i const lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  __m128i const mask_2f = _mm_set1_epi8(0x2f);
+  __m128i const pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  for(; n - done >= 16; done += 16, dst += 12) {
+    __m128i in = _mm_loadu_si128((__m128i const *)(src + done));
+    __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    __m128i lo_nibbles = _mm_and_si128(in, mask_2f);
+    __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+    __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    if(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())))
+      break;
+    __m128i eq_2f = _mm_cmpeq_epi8(in, mask_2f);
+    __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+    __m128i values = _mm_add_epi8(in, roll);
+    __m128i pairs = _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140));
+    __m128i words = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+    _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(words, pack));
+  }
+  return done;
+}
+#endif
+
+// encodes n bytes to 4 * ceil(n / 3) digits with padding
+__attribute__((visibility("hidden")))
+size_t d_base64_encode_impl(char * dst, unsigned char const * src, size_t n) {
+  char * start = dst;
+  size_t i = 0;
+#ifdef HAVE_SSSE3_KERNELS
+  if(has_ssse3()) {
+    i = base64_encode_ssse3(dst, src, n);
+    dst += i / 3 * 4;
+  }
+#endif
+  for(; n - i >= 3; i += 3) {
+    uint32_t v = src[i] << 16 | src[i + 1] << 8 | src[i + 2];
+    *dst++ = base64_digits[v >> 18];
+    *dst++ = base64_digits[v >> 12 & 63];
+    *dst++ = base64_digits[v >> 6 & 63];
+    *dst++ = base64_digits[v & 63];
+  }
+  if(n - i) {
+    uint32_t v = src[i] << 16 | (n - i > 1 ? src[i + 1] << 8 : 0);
+    *dst++ = base64_digits[v >> 18];
+    *dst++ = base64_digits[v >> 12 & 63];
+    *dst++ = n - i > 1 ? base64_digits[v >> 6 & 63] : '=';
+    *dst++ = '=';
+  }
+  return dst - start;
+}
+
+// the read adapter decodes from src as it's read. whitespace between
+// digits is skipped, decoding ends at padding or src's eof, and
+// anything else fails the read with EILSEQ
+typedef struct base64_cookie {
+  DFILE * src;
+  bool done;
+  int error;
+  int nquad;
+  unsigned char quad[4];
+  int ncarry;
+  unsigned char carry[3];
+  int in_pos;
+  int in_len;
+  char in[D_BUFSIZ];
+} base64_cookie;
+
+// reports what was decoded before the error, then the error on every
+// read after
+static ssize_t fail_base64(base64_cookie * c, size_t got, int error) {
+  c->done = true;
+  c->ncarry = 0;
+  c->error = error;
+  if(got)
+    return got;
+  errno = error;
+  return -1;
+}
+
+// decodes the nquad digits, with nquad < 4 meaning padding followed
+static int flush_quad(base64_cookie * c) {
+  if(c->nquad == 1)
+    return -1;
+  uint32_t v = 0;
+  for(int i = 0; i < 4; i++)
+    v = v << 6 | (i < c->nquad ? c->quad[i] : 0);
+  c->carry[0] = v >> 16;
+  c->carry[1] = v >> 8;
+  c->carry[2] = v;
+  c->ncarry = c->nquad ? c->nquad - 1 : 0;
+  c->nquad = 0;
+  return 0;
+}
+
+static ssize_t read_base64(void * cookie, char * buf, size_t size) {
+  base64_cookie * c = cookie;
+  size_t got = 0;
+  if(c->error) {
+    errno = c->error;
+    return -1;
+  }
+  while(got < size) {
+    if(c->ncarry) {
+      // a decoded group that didn't fit last time, kept in order
+      size_t n = size - got < (size_t)c->ncarry ? size - got : (size_t)c->ncarry;
+      memcpy(buf + got, c->carry, n);
+      memmove(c->carry, c->carry + n, c->ncarry - n);
+      c->ncarry -= n;
+      got += n;
+      continue;
+    }
+    if(c->done)
+      break;
+    if(c->in_pos == c->in_len) {
+      // src may be shared, and this stream's lock doesn't cover it
+      int ret = d_fread(c->in, sizeof c->in, c->src);
+      if(ret < 0)
+        return fail_base64(c, got, errno ? errno : EIO);
+      c->in_pos = 0;
+      c->in_len = ret;
+      if(!ret) {
+        c->done = true;
+        if(c->nquad && flush_quad(c) < 0)
+          return fail_base64(c, got, EILSEQ);
+        continue;
+      }
+    }
+#ifdef HAVE_SSSE3_KERNELS
+    if(!c->nquad && size - got >= 16 && has_ssse3()) {
+      size_t blocks = (size - got - 4) / 12;
+      size_t avail = (c->in_len - c->in_pos) / 16;
+      size_t n = base64_decode_ssse3((unsigned char *)buf + got, c->in + c->in_pos,
+                                     16 * (blocks < avail ? blocks : avail));
+      c->in_pos += n;
+      got += n / 16 * 12;
+    }
+#endif
+    // whitespace stops the vector loop, so once past some, at the next
+    // group boundary go back to it. wrapped lines then only take the
+    // scalar path around each line break
+    bool skipped = false;
+    while(c->in_pos < c->in_len && got + 3 <= size) {
+      unsigned char v = base64_values[(unsigned char)c->in[c->in_pos++]];
+      if(v < 64) {
+        c->quad[c->nquad++] = v;
+        if(c->nquad == 4) {
+          uint32_t w = c->quad[0] << 18 | c->quad[1] << 12 | c->quad[2] << 6 | c->quad[3];
+          buf[got++] = w >> 16;
+          buf[got++] = w >> 8;
+          buf[got++] = w;
+          c->nquad = 0;
+          if(skipped)
+            break;
+        }
+      } else if(v == B64_PAD) {
+        c->done = true;
+        if(flush_quad(c) < 0)
+          return fail_base64(c, got, EILSEQ);
+        break;
+      } else if(v == B64_BAD) {
+        return fail_base64(c, got, EILSEQ);
+      } else {
+        skipped = true;
+      }
+    }
+    // less than a group's room left, decode the next group into carry
+    if(got + 3 > size && got < size && !c->done) {
+      while(c->in_pos < c->in_len && c->nquad < 4) {
+        unsigned char v = base64_values[(unsigned char)c->in[c->in_pos++]];
+        if(v < 64) {
+          c->quad[c->nquad++] = v;
+        } else if(v == B64_PAD) {
+          c->done = true;
+          break;
+        } else if(v == B64_BAD) {
+          return fail_base64(c, got, EILSEQ);
+        }
+      }
+      if((c->nquad == 4 || c->done) && flush_quad(c) < 0)
+        return fail_base64(c, got, EILSEQ);
+    }
+  }
+  return got;
+}
+
+static int close_base64(void * cookie) {
+  free(cookie);
+  return 0;
+}
+
+DFILE * d_open_base64stream(DFILE * src) {
+  base64_cookie * c = malloc(sizeof *c);
+  if(!c)
+    return NULL;
+  *c = (base64_cookie) { .src = src };
+  d_cookie_io_functions_t funcs = { .read = read_base64, .close = close_base64 };
+  DFILE * ret = d_fopencookie(c, "r", funcs);
+  if(!ret)
+    free(c);
+  return ret;
+}
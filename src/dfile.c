@@ -22,8 +22,18 @@
 #define _GNU_SOURCE
 #include <unistd.h>
 #include <pthread.h>
+#include <poll.h>
 #include <sys/wait.h>
 #endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#define HAVE_SINGLE_THREADED
+#endif
+#endif
 
 #ifdef _WIN64
 #include <stdio.h>
@@ -42,6 +52,8 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <stddef.h>
+#include <limits.h>
 
 #include "dfile.h"
 
@@ -167,6 +179,10 @@ enum {
   DFILE_STRFILE = 128,
   DFILE_COOKIE = 256,
   DFILE_PROCESS = 512,
+  DFILE_NONBLOCK = 1024,
+  DFILE_USER_LOCKING = 2048,
+  DFILE_SINK = 4096,
+  DFILE_DEFERRED = 8192,
 };
 enum { DFILE_CANARY = 0xDF11E83 };
 
@@ -175,17 +191,53 @@ typedef struct STRPAGE {
   char buf[D_BUFSIZ];
 } STRPAGE;
 
-enum { DFILE_UNGETS = 8 };
-typedef struct DFILE_TAIL {
 #ifdef _WIN64
-  CRITICAL_SECTION lock;
+typedef CRITICAL_SECTION dmutex;
+typedef CRITICAL_SECTION dflock;
+#elif defined(__linux__)
+typedef pthread_mutex_t dmutex;
+// stream locks are taken around every locked call, so they're an owner
+// and recursion count behind a single compare and swap, with a futex
+// to sleep on under contention. state is 0 when unlocked, 1 when locked
+// and 2 when locked with waiters
+typedef struct dflock {
+  int state;
+  int count;
+  void * owner;
+} dflock;
 #else
-  pthread_mutex_t lock;
+typedef pthread_mutex_t dmutex;
+typedef pthread_mutex_t dflock;
 #endif
-  DFILE * prev;
+
+enum { DFILE_UNGETS = 8 };
+enum { DFILE_DEFERRED_FORMATS = 64 };
+// id is the format's record id. plan is owned by the stream, or NULL
+// when the id is a caller's d_fmt
+typedef struct DFILE_DEFERRED_FORMAT {
+  uint64_t id;
+  d_fmt * plan;
+} DFILE_DEFERRED_FORMAT;
+enum { DFILE_GATHER = 8, DFILE_GATHER_MIN = 1024 };
+typedef struct DFILE_TAIL {
+  dflock lock;
+  // membership in the open stream list of shard
+  int shard;
   DFILE * next;
+  DFILE ** pprev;
+  // membership in the dirty registry. the links belong to the
+  // dirty lock, listed only changes while also holding this stream's lock
+  bool listed;
+  DFILE * dirty_next;
+  DFILE ** dirty_pprev;
 } DFILE_TAIL;
 
+typedef struct DFILE_PIECE {
+  char const * ptr;
+  int len;
+  int at;
+} DFILE_PIECE;
+
 typedef struct DFILE {
   // invariant:
   // the underlying cursor of the fd is at the buf_cursor
@@ -201,6 +253,16 @@ typedef struct DFILE {
   char buf_storage[D_BUFSIZ];
   int num_ungets;
   char ungets[DFILE_UNGETS];
+  // formats a deferred stream has already written the text of, with
+  // the parse printf made of them. direct mapped by id so a collision
+  // just parses and writes it again. allocated while deferred
+  DFILE_DEFERRED_FORMAT * deferred_formats;
+  // large pieces of a printf call, written by reference from the
+  // caller's memory in one writev with the buffered bytes around them.
+  // at is the dirty_cursor the piece goes after
+  bool gathering;
+  int num_gathered;
+  DFILE_PIECE gathered[DFILE_GATHER];
   // strfile stuff
   off_t tell;
   off_t len;
@@ -223,6 +285,15 @@ typedef struct DFILE_STORAGE {
   DFILE_TAIL tail;
 } DFILE_STORAGE;
 
+// d_feof and friends read the flags without taking the lock, so
+// changes made after a stream is open are atomic
+static void dset_flags(DFILE * f, int flags) {
+  __atomic_fetch_or(&f->flags, flags, __ATOMIC_RELAXED);
+}
+static void dclear_flags(DFILE * f, int flags) {
+  __atomic_fetch_and(&f->flags, ~flags, __ATOMIC_RELAXED);
+}
+
 static DFILE * malloc_dfile() {
   void * ret = malloc(sizeof(DFILE_STORAGE));
   memset(ret, 0, sizeof(DFILE_STORAGE));
@@ -244,9 +315,6 @@ DFILE_STORAGE dstdin_impl = {
     .buf_size = D_BUFSIZ,
     .buf = dstdin_impl.f.buf_storage,
   },
-  .tail = {
-    .next = &dstdout_impl.f,
-  },
 };
 DFILE_STORAGE dstdout_impl = {
   .f = {
@@ -256,10 +324,6 @@ DFILE_STORAGE dstdout_impl = {
     .buf_size = D_BUFSIZ,
     .buf = dstdout_impl.f.buf_storage,
   },
-  .tail = {
-    .next = &dstderr_impl.f,
-    .prev = &dstdin_impl.f,
-  },
 };
 DFILE_STORAGE dstderr_impl = {
   .f = {
@@ -269,124 +333,283 @@ DFILE_STORAGE dstderr_impl = {
     .buf_size = D_BUFSIZ,
     .buf = dstderr_impl.f.buf_storage,
   },
-  .tail = {
-    .next = NULL,
-    .prev = &dstdout_impl.f,
-  },
 };
 
-static DFILE_TAIL dlist_mutex;
-static void d_locklist() {
+#if defined(__linux__) || defined(__EMSCRIPTEN__)
+static pthread_mutexattr_t recursive_attr;
+#endif
+static void init_dmutex(dmutex * m) {
 #ifdef _WIN64
-  EnterCriticalSection(&dlist_mutex.lock);
+  InitializeCriticalSectionAndSpinCount(m, 32);
 #else
-  pthread_mutex_lock(&dlist_mutex.lock);
+  pthread_mutex_init(m, &recursive_attr);
 #endif
 }
-static void d_unlocklist() {
+static int destroy_dmutex(dmutex * m) {
 #ifdef _WIN64
-  LeaveCriticalSection(&dlist_mutex.lock);
+  DeleteCriticalSection(m);
+  return 0;
 #else
-  pthread_mutex_unlock(&dlist_mutex.lock);
+  return pthread_mutex_destroy(m);
+#endif
+}
+static void dmutex_lock(dmutex * m) {
+#ifdef _WIN64
+  EnterCriticalSection(m);
+#else
+  pthread_mutex_lock(m);
+#endif
+}
+static void dmutex_unlock(dmutex * m) {
+#ifdef _WIN64
+  LeaveCriticalSection(m);
+#else
+  pthread_mutex_unlock(m);
 #endif
 }
 
+#ifdef __linux__
+// the address of any thread local is a cheap thread id. initial-exec
+// keeps it from costing a __tls_get_addr call in the shared library
+static _Thread_local char dthread_self __attribute__((tls_model("initial-exec")));
+
+// until the process creates its first thread nobody can contend, so
+// the lock word is updated with plain stores instead of atomics. a
+// thread created while the lock is held sees state 1 and the unlock
+// after it uses the exchange, so the two modes can mix
+static inline bool dsingle_threaded() {
+#ifdef HAVE_SINGLE_THREADED
+  return __libc_single_threaded;
+#else
+  return false;
+#endif
+}
+
+static void init_dflock(dflock * l) {
+  *l = (dflock) { 0 };
+}
+static int destroy_dflock(dflock * l) {
+  return l->state ? EBUSY : 0;
+}
+static int dflock_trylock(dflock * l) {
+  void * self = &dthread_self;
+  if(__atomic_load_n(&l->owner, __ATOMIC_RELAXED) == self) {
+    l->count++;
+    return 0;
+  }
+  if(dsingle_threaded()) {
+    if(__atomic_load_n(&l->state, __ATOMIC_RELAXED))
+      return EBUSY;
+    __atomic_store_n(&l->state, 1, __ATOMIC_RELAXED);
+  } else {
+    int unlocked = 0;
+    if(!__atomic_compare_exchange_n(&l->state, &unlocked, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return EBUSY;
+  }
+  __atomic_store_n(&l->owner, self, __ATOMIC_RELAXED);
+  l->count = 1;
+  return 0;
+}
+static void dflock_lock(dflock * l) {
+  if(!dflock_trylock(l))
+    return;
+  // mark the lock as having waiters so the unlock knows to wake us
+  while(__atomic_exchange_n(&l->state, 2, __ATOMIC_ACQUIRE))
+    syscall(SYS_futex, &l->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+  __atomic_store_n(&l->owner, (void*)&dthread_self, __ATOMIC_RELAXED);
+  l->count = 1;
+}
+static void dflock_unlock(dflock * l) {
+  if(--l->count)
+    return;
+  __atomic_store_n(&l->owner, NULL, __ATOMIC_RELAXED);
+  if(dsingle_threaded())
+    __atomic_store_n(&l->state, 0, __ATOMIC_RELAXED);
+  else if(__atomic_exchange_n(&l->state, 0, __ATOMIC_RELEASE) == 2)
+    syscall(SYS_futex, &l->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#else
+static void init_dflock(dflock * l) {
+  init_dmutex(l);
+}
+static int destroy_dflock(dflock * l) {
+  return destroy_dmutex(l);
+}
+static int dflock_trylock(dflock * l) {
+#ifdef _WIN64
+  // wat.
+  return TryEnterCriticalSection(l) ? 0 : -1;
+#else
+  return pthread_mutex_trylock(l);
+#endif
+}
+static void dflock_lock(dflock * l) {
+  dmutex_lock(l);
+}
+static void dflock_unlock(dflock * l) {
+  dmutex_unlock(l);
+}
+#endif
+
+// the library's own locking goes through these rather than the
+// exported d_flockfile so the fast path inlines. they do nothing on
+// streams the caller has taken over locking for with d_fsetlocking
+static inline void lock_dfile(DFILE * f) {
+  if(!(f->flags & DFILE_USER_LOCKING))
+    dflock_lock(&f->tail[0].lock);
+}
+static inline int trylock_dfile(DFILE * f) {
+  if(f->flags & DFILE_USER_LOCKING)
+    return 0;
+  return dflock_trylock(&f->tail[0].lock) ? -1 : 0;
+}
+static inline void unlock_dfile(DFILE * f) {
+  if(!(f->flags & DFILE_USER_LOCKING))
+    dflock_unlock(&f->tail[0].lock);
+}
+
+// open streams are spread over shards so opens and closes on different
+// threads don't serialize on one lock. a thread sticks to one shard and
+// a stream remembers the shard it joined.
+//
+// each shard also keeps a dirty registry holding only the streams with
+// pending output, split by whether they're line buffered, so flushing
+// before a line buffered read or on d_fflush(NULL) doesn't visit every
+// open stream. writers register while holding their own stream lock, so
+// the dirty lock is taken after stream locks and walkers can only
+// trylock streams
+enum { DLIST_SHARDS = 16 };
+typedef struct DLIST_SHARD {
+  dmutex lock;
+  DFILE * head;
+  dmutex dirty_lock;
+  DFILE * dirty[2];
+} __attribute__((aligned(64))) DLIST_SHARD;
+static DLIST_SHARD dlist_shards[DLIST_SHARDS];
+
+static int dlist_shard() {
+  static int next_shard;
+  static _Thread_local int shard = -1;
+  if(shard < 0)
+    shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % DLIST_SHARDS;
+  return shard;
+}
+
 static void insert_dfile_list(DFILE * d) {
-  d_locklist();
-  DFILE * root;
-  if(d->flags & DFILE_LINE_BUFFERED)
-    root = dstdin;
-  else
-    root = dstderr;
-
-  assert(!d->tail->prev);
+  assert(!d->tail->pprev);
   assert(!d->tail->next);
 
-  if(root->tail->next)
-    root->tail->next->tail->prev = d;
-
-  d->tail->next = root->tail->next;
-  d->tail->prev = root;
+  d->tail->shard = dlist_shard();
+  DLIST_SHARD * shard = &dlist_shards[d->tail->shard];
+  dmutex_lock(&shard->lock);
 
-  root->tail->next = d;
+  d->tail->next = shard->head;
+  if(shard->head)
+    shard->head->tail->pprev = &d->tail->next;
+  d->tail->pprev = &shard->head;
+  shard->head = d;
 
-  d_unlocklist();
+  dmutex_unlock(&shard->lock);
 }
 static void remove_dfile_list(DFILE * d) {
-  d_locklist();
-
   assert(d != dstdin);
   assert(d != dstdout);
   assert(d != dstderr);
 
-  d->tail->prev->tail->next = d->tail->next;
+  DLIST_SHARD * shard = &dlist_shards[d->tail->shard];
+  dmutex_lock(&shard->lock);
+
+  *d->tail->pprev = d->tail->next;
   if(d->tail->next)
-    d->tail->next->tail->prev = d->tail->prev;
+    d->tail->next->tail->pprev = d->tail->pprev;
 
   d->tail->next = NULL;
-  d->tail->prev = NULL;
+  d->tail->pprev = NULL;
 
-  d_unlocklist();
+  dmutex_unlock(&shard->lock);
 }
-static void reseat_dfile_list(int before_flags, DFILE * d) {
-  if(d == dstdin ||
-     d == dstdout ||
-     d == dstderr)
+
+static void mark_dirty(DFILE * d) {
+  if(d->tail->listed)
+    return;
+  DLIST_SHARD * shard = &dlist_shards[d->tail->shard];
+  dmutex_lock(&shard->dirty_lock);
+  DFILE ** head = &shard->dirty[!!(d->flags & DFILE_LINE_BUFFERED)];
+  d->tail->dirty_next = *head;
+  if(*head)
+    (*head)->tail->dirty_pprev = &d->tail->dirty_next;
+  d->tail->dirty_pprev = head;
+  *head = d;
+  d->tail->listed = true;
+  dmutex_unlock(&shard->dirty_lock);
+}
+static void mark_clean(DFILE * d) {
+  if(!d->tail->listed)
     return;
-  bool before_linebuf = before_flags & DFILE_LINE_BUFFERED;
-  bool after_linebuf = d->flags & DFILE_LINE_BUFFERED;
-  if(before_linebuf != after_linebuf) {
-    d_locklist();
-    remove_dfile_list(d);
-    insert_dfile_list(d);
-    d_unlocklist();
+  DLIST_SHARD * shard = &dlist_shards[d->tail->shard];
+  dmutex_lock(&shard->dirty_lock);
+  *d->tail->dirty_pprev = d->tail->dirty_next;
+  if(d->tail->dirty_next)
+    d->tail->dirty_next->tail->dirty_pprev = d->tail->dirty_pprev;
+  d->tail->dirty_next = NULL;
+  d->tail->dirty_pprev = NULL;
+  d->tail->listed = false;
+  dmutex_unlock(&shard->dirty_lock);
+}
+
+// the slow path for when a dirty stream is held by another thread
+static int flush_all_dfile_list() {
+  int ret = 0;
+  for(int i = 0; i < DLIST_SHARDS; i++) {
+    DLIST_SHARD * shard = &dlist_shards[i];
+    dmutex_lock(&shard->lock);
+    for(DFILE * cur = shard->head; cur; cur = cur->tail->next) {
+      if(cur->flags & DFILE_WRITE) {
+        lock_dfile(cur);
+        ret |= d_fflush_unlocked(cur);
+        unlock_dfile(cur);
+      }
+    }
+    dmutex_unlock(&shard->lock);
   }
+  return ret;
 }
 static int flush_dfile_list(bool linebuf_only) {
-  int test = linebuf_only ? DFILE_LINE_BUFFERED : 0;
-  test |= DFILE_WRITE;
-  d_locklist();
-  DFILE * end = linebuf_only ? dstderr->tail->next : NULL;
-  DFILE * cur = dstdin;
+  bool busy = false;
   int ret = 0;
-  while(cur != end) {
-    if((cur->flags & test) == test) {
-      d_flockfile(cur);
-      ret |= d_fflush_unlocked(cur);
-      d_funlockfile(cur);
+  for(int i = 0; i < DLIST_SHARDS; i++) {
+    DLIST_SHARD * shard = &dlist_shards[i];
+    dmutex_lock(&shard->dirty_lock);
+    for(int linebuf = 1; linebuf >= linebuf_only; linebuf--) {
+      DFILE * cur = shard->dirty[linebuf];
+      while(cur) {
+        // flushing unlinks cur, so step first
+        DFILE * next = cur->tail->dirty_next;
+        if(trylock_dfile(cur) == 0) {
+          ret |= d_fflush_unlocked(cur);
+          unlock_dfile(cur);
+        } else {
+          busy = true;
+        }
+        cur = next;
+      }
     }
-    cur = cur->tail->next;
+    dmutex_unlock(&shard->dirty_lock);
   }
-  d_unlocklist();
+  // a line buffered read doesn't need to wait on another thread's
+  // output, but flushing everything does
+  if(busy && !linebuf_only)
+    ret |= flush_all_dfile_list();
   return ret;
 }
 
-#if defined(__linux__) || defined(__EMSCRIPTEN__)
-static pthread_mutexattr_t recursive_attr;
-#endif
-static void init_dfile_lock(DFILE_TAIL * tail) {
-#ifdef _WIN64
-  InitializeCriticalSectionAndSpinCount(&tail->lock, 32);
-#else
-  pthread_mutex_init(&tail->lock, &recursive_attr);
-#endif
-}
-static int destroy_dfile_lock(DFILE_TAIL * tail) {
-#ifdef _WIN64
-  DeleteCriticalSection(&tail->lock);
-  return 0;
-#else
-  return pthread_mutex_destroy(&tail->lock);
-#endif
-}
-
 static void init_dfile_tail(DFILE * f) {
-  init_dfile_lock(f->tail);
+  init_dflock(&f->tail->lock);
   insert_dfile_list(f);
 }
 static int destroy_dfile_tail(DFILE * f) {
   remove_dfile_list(f);
-  return destroy_dfile_lock(f->tail);
+  return destroy_dflock(&f->tail->lock);
 }
 
 __attribute__((constructor(101)))
@@ -395,12 +618,15 @@ static void init_stdio() {
   pthread_mutexattr_init(&recursive_attr);
   pthread_mutexattr_settype(&recursive_attr, PTHREAD_MUTEX_RECURSIVE);
 #endif
-  
-  init_dfile_lock(&dlist_mutex);
 
-  init_dfile_lock(dstdin_impl.f.tail);
-  init_dfile_lock(dstdout_impl.f.tail);
-  init_dfile_lock(dstderr_impl.f.tail);
+  for(int i = 0; i < DLIST_SHARDS; i++) {
+    init_dmutex(&dlist_shards[i].lock);
+    init_dmutex(&dlist_shards[i].dirty_lock);
+  }
+
+  init_dfile_tail(dstdin);
+  init_dfile_tail(dstdout);
+  init_dfile_tail(dstderr);
 }
 
 __attribute__((destructor(101)))
@@ -413,8 +639,11 @@ static void flush_stdio() {
   //d_fflush_unlocked(dstdout);
   //d_fflush_unlocked(dstderr);
   flush_dfile_list(false);
-  
-  destroy_dfile_lock(&dlist_mutex);
+
+  for(int i = 0; i < DLIST_SHARDS; i++) {
+    destroy_dmutex(&dlist_shards[i].lock);
+    destroy_dmutex(&dlist_shards[i].dirty_lock);
+  }
 }
 
 static off64_t dseek(DFILE * f, off64_t offset, int whence) {
@@ -453,11 +682,14 @@ static off64_t dseek(DFILE * f, off64_t offset, int whence) {
 }
 
 long long int d_ftell(DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   off_t o = dseek(f, 0, D_SEEK_CUR);
-  d_funlockfile(f);
+  unlock_dfile(f);
   if(o < 0) return o;
-  return o - f->buf_cursor - f->num_ungets + f->dirty_cursor;
+  long long gathered = 0;
+  for(int i = 0; i < f->num_gathered; i++)
+    gathered += f->gathered[i].len;
+  return o - f->buf_cursor - f->num_ungets + f->dirty_cursor + gathered;
 }
 
 int d_fgetpos(DFILE * f, off64_t *pos) {
@@ -465,9 +697,9 @@ int d_fgetpos(DFILE * f, off64_t *pos) {
   return -(*pos < 0);
 }
 int d_fsetpos(DFILE * f, off64_t *pos) {
-  d_flockfile(f);
+  lock_dfile(f);
   int ret = d_fseek(f, *pos, D_SEEK_SET);
-  d_funlockfile(f);
+  unlock_dfile(f);
   return ret;
 }
 
@@ -480,14 +712,22 @@ int d_ferror_unlocked(DFILE * f) {
 }
 
 void d_clearerror_unlocked(DFILE * f) {
-  f->flags &= ~(DFILE_EOF | DFILE_ERROR);
+  dclear_flags(f, DFILE_EOF | DFILE_ERROR);
+}
+
+int d_fpending_write_unlocked(DFILE * f) {
+  return f->dirty_cursor;
+}
+
+int d_fbuffered_read_unlocked(DFILE * f) {
+  return f->buf_cursor + f->num_ungets;
 }
 
 void d_rewind(DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   d_fseek(f, 0, D_SEEK_SET);
   d_clearerror_unlocked(f);
-  d_funlockfile(f);
+  unlock_dfile(f);
 }
 
 static DFILE * d_fdopen_impl(int fd, char const * mode, DFILE * ret) {
@@ -509,6 +749,14 @@ static DFILE * d_fdopen_impl(int fd, char const * mode, DFILE * ret) {
     bitfield |= DFILE_LINE_BUFFERED;
   if(strchr(mode, 'u'))
     bitfield |= DFILE_UNBUFFERED;
+  if(strchr(mode, 'n')) {
+    bitfield |= DFILE_NONBLOCK;
+#if defined(__linux__) || defined(__EMSCRIPTEN__)
+    int fl = fcntl(fd, F_GETFL);
+    if(fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0)
+      return NULL;
+#endif
+  }
 
   if(isatty(fd))
     bitfield |= DFILE_LINE_BUFFERED;
@@ -553,6 +801,8 @@ static DFILE * d_fopencookie_impl(void * cookie, char const * mode, d_cookie_io_
     bitfield |= DFILE_LINE_BUFFERED;
   if(strchr(mode, 'u'))
     bitfield |= DFILE_UNBUFFERED;
+  if(strchr(mode, 'n'))
+    bitfield |= DFILE_NONBLOCK;
 
   *ret = (DFILE) {
     .canary = DFILE_CANARY,
@@ -578,16 +828,15 @@ DFILE * d_fopencookie(void * cookie, char const * mode, d_cookie_io_functions_t
 }
 
 int d_setvbuf(DFILE * f, char * buf, int mode, size_t size) {
-  d_flockfile(f);
+  lock_dfile(f);
   d_fflush_unlocked(f);
-  int oldflags = f->flags;
-  f->flags &= ~(DFILE_LINE_BUFFERED | DFILE_UNBUFFERED);
+  dclear_flags(f, DFILE_LINE_BUFFERED | DFILE_UNBUFFERED);
   switch(mode) {
   case D_IONBF:
-    f->flags |= DFILE_UNBUFFERED;
+    dset_flags(f, DFILE_UNBUFFERED);
     break;
   case D_IOLBF:
-    f->flags |= DFILE_LINE_BUFFERED;
+    dset_flags(f, DFILE_LINE_BUFFERED);
     break;
   case D_IOFBF:
     /* absense of flags means fully buffered */
@@ -600,8 +849,7 @@ int d_setvbuf(DFILE * f, char * buf, int mode, size_t size) {
     f->buf = f->buf_storage;
     f->buf_size = D_BUFSIZ;
   }
-  reseat_dfile_list(oldflags, f);
-  d_funlockfile(f);
+  unlock_dfile(f);
   return 0;
 }
 void d_setbuf(DFILE * f, char buf[D_BUFSIZ]) {
@@ -615,10 +863,7 @@ void d_setlinebuf(DFILE * f) {
 }
 
 int d_fileno_unlocked(DFILE * f) {
-  d_flockfile(f);
-  int ret = f->fd;
-  d_funlockfile(f);
-  return ret;
+  return f->fd;
 }
 
 //////////////////////////////////////////
@@ -979,9 +1224,19 @@ DFILE * d_fopen_impl(char const * path, char const * mode, DFILE * f) {
     break;
   }
 
+#if defined(__linux__) || defined(__EMSCRIPTEN__)
+  // opened that way, so the open itself doesn't block either
+  if(strchr(mode, 'n'))
+    flags |= O_NONBLOCK;
+#endif
+
   int fd = open(path, flags);
   if(fd < 0) return NULL;
-  return d_fdopen_impl(fd, mode, f);
+  if(!d_fdopen_impl(fd, mode, f)) {
+    close(fd);
+    return NULL;
+  }
+  return f;
 }
 DFILE * d_fopen(char const * path, char const * mode) {
   DFILE * ret = malloc_dfile();
@@ -1117,10 +1372,77 @@ static int read_strfile(DFILE * f, char * ptr, int nbytes) {
   return ret;
 }
 
+// in nonblocking mode EAGAIN isn't an error, the data just stays buffered
+static bool dwould_block(DFILE * f) {
+  return (f->flags & DFILE_NONBLOCK) && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// a blocking DFILE whose fd got O_NONBLOCK set behind its back.
+// wait for the fd instead of spinning on EAGAIN
+static void dwait_fd(int fd, bool for_write) {
+#if defined(__linux__) || defined(__EMSCRIPTEN__)
+  struct pollfd p = { .fd = fd, .events = for_write ? POLLOUT : POLLIN };
+  poll(&p, 1, -1);
+#endif
+}
+
+#ifdef __linux__
+// writes the buffer with the gathered pieces spliced in, leaving both empty
+static int dgather_flush(DFILE * f) {
+  struct iovec iov[2 * DFILE_GATHER + 1];
+  int n = 0, at = 0;
+  for(int i = 0; i < f->num_gathered; i++) {
+    if(f->gathered[i].at > at)
+      iov[n++] = (struct iovec) { f->buf + at, f->gathered[i].at - at };
+    iov[n++] = (struct iovec) { (void*)f->gathered[i].ptr, f->gathered[i].len };
+    at = f->gathered[i].at;
+  }
+  if(f->dirty_cursor > at)
+    iov[n++] = (struct iovec) { f->buf + at, f->dirty_cursor - at };
+  f->num_gathered = 0;
+  f->dirty_cursor = 0;
+  mark_clean(f);
+  if(f->buf_cursor) {
+    dseek(f, -f->buf_cursor, D_SEEK_CUR);
+    f->buf_cursor = 0;
+  }
+
+  struct iovec * cur = iov;
+  while(n) {
+    ssize_t ret = writev(f->fd, cur, n);
+    if(ret < 0) {
+      if(errno != EAGAIN && errno != EWOULDBLOCK) {
+        dset_flags(f, DFILE_ERROR);
+        return -1;
+      }
+      dwait_fd(f->fd, true);
+      errno = 0;
+      continue;
+    }
+    while(n && (size_t)ret >= cur->iov_len) {
+      ret -= cur->iov_len;
+      cur++;
+      n--;
+    }
+    if(n) {
+      cur->iov_base = (char*)cur->iov_base + ret;
+      cur->iov_len -= ret;
+    }
+  }
+  return 0;
+}
+#endif
+
 static int d_fflush_unlocked_impl(DFILE * f, int flushbytes) {
   assert(f->canary == DFILE_CANARY);
+#ifdef __linux__
+  // gathering streams are fully buffered, so this flushes everything
+  if(f->num_gathered)
+    return dgather_flush(f);
+#endif
   void * ptr = f->buf;
   int nbytes = flushbytes;
+  int status = 0;
   if(f->buf_cursor) {
     dseek(f, -f->buf_cursor, D_SEEK_CUR);
     f->buf_cursor = 0;
@@ -1138,9 +1460,16 @@ static int d_fflush_unlocked_impl(DFILE * f, int flushbytes) {
       int ret = write(f->fd, ptr, nbytes);
       if(ret < 0) {
         if(errno != EAGAIN && errno != EWOULDBLOCK) {
-          f->flags |= DFILE_ERROR;
+          dset_flags(f, DFILE_ERROR);
           return -1;
         }
+        if(f->flags & DFILE_NONBLOCK) {
+          // keep the unwritten tail buffered for the next flush
+          flushbytes -= nbytes;
+          status = -1;
+          break;
+        }
+        dwait_fd(f->fd, true);
         errno = 0;
       } else {
         nbytes -= ret;
@@ -1150,14 +1479,16 @@ static int d_fflush_unlocked_impl(DFILE * f, int flushbytes) {
   }
   memmove(f->buf, f->buf + flushbytes, f->dirty_cursor - flushbytes);
   f->dirty_cursor -= flushbytes;
-  return 0;
+  if(!f->dirty_cursor)
+    mark_clean(f);
+  return status;
 }
 
 int d_fflush_unlocked(DFILE * f) {
   if(!f)
     return flush_dfile_list(false);
 
-  if(f->dirty_cursor) {
+  if(f->dirty_cursor || f->num_gathered) {
     if(d_fflush_unlocked_impl(f, f->dirty_cursor) < 0)
       return -1;
   }
@@ -1173,7 +1504,7 @@ int d_fflush_unlocked(DFILE * f) {
 
 int d_fseek(DFILE * f, int offset, int whence) {
   assert(f->canary == DFILE_CANARY);
-  d_flockfile(f);
+  lock_dfile(f);
   if(d_fflush_unlocked(f) < 0)
     goto failure;
   if(whence == D_SEEK_CUR) {
@@ -1190,16 +1521,27 @@ int d_fseek(DFILE * f, int offset, int whence) {
   }
   goto failure;
 success:
-  d_funlockfile(f);
+  unlock_dfile(f);
   return 0;
 failure:
-  f->flags |= DFILE_ERROR;
-  d_funlockfile(f);
+  dset_flags(f, DFILE_ERROR);
+  unlock_dfile(f);
   return -1;
 }
 
+static void clear_deferred_formats(DFILE * f) {
+  if(!f->deferred_formats)
+    return;
+  for(int i = 0; i < DFILE_DEFERRED_FORMATS; i++)
+    d_fmt_free(f->deferred_formats[i].plan);
+  free(f->deferred_formats);
+  f->deferred_formats = NULL;
+}
+
 static int d_fclose_impl(DFILE * f) {
   d_fflush_unlocked(f);
+  mark_clean(f);
+  clear_deferred_formats(f);
   int ret;
   if(f->flags & DFILE_STRFILE) {
     STRPAGE * page = f->strpages;
@@ -1250,12 +1592,10 @@ DFILE * d_freopen(char const * path, char const * mode, DFILE * stream) {
   if(!path)
     goto fail;
     
-  int oldflags = stream->flags;
   d_fclose_impl(stream);
 
   if(!d_fopen_impl(path, mode, stream))
     goto fail;
-  reseat_dfile_list(oldflags, stream);
 
   return stream;
   
@@ -1268,12 +1608,10 @@ fail:
 }
 
 DFILE * d_fdreopen(int fd, char const * mode, DFILE * stream) {
-  int oldflags = stream->flags;
   d_fclose_impl(stream);
 
   if(!d_fdopen_impl(fd, mode, stream))
     goto fail;
-  reseat_dfile_list(oldflags, stream);
 
   return stream;
   
@@ -1286,12 +1624,10 @@ fail:
 }
 
 DFILE * d_retmpfile(DFILE * stream) {
-  int oldflags = stream->flags;
   d_fclose_impl(stream);
 
   if(!d_tmpfile_impl(stream))
     goto fail;
-  reseat_dfile_list(oldflags, stream);
 
   return stream;
   
@@ -1303,12 +1639,10 @@ fail:
   return NULL;
 }
 DFILE * d_restrfile(DFILE * stream) {
-  int oldflags = stream->flags;
   d_fclose_impl(stream);
 
   if(!d_strfile_impl(stream))
     goto fail;
-  reseat_dfile_list(oldflags, stream);
 
   return stream;
   
@@ -1321,12 +1655,10 @@ fail:
 }
 
 DFILE * d_freopencookie(void * cookie, char const * mode, d_cookie_io_functions_t funcs, DFILE * stream) {
-  int oldflags = stream->flags;
   d_fclose_impl(stream);
 
   if(!d_fopencookie_impl(cookie, mode, funcs, stream))
     goto fail;
-  reseat_dfile_list(oldflags, stream);
 
   return stream;
   
@@ -1339,7 +1671,6 @@ fail:
 }
 
 DFILE * d_fmemreopen(void * buf, size_t size, char const * _mode, DFILE * f) {
-  int oldflags = f->flags;
   if(f->flags & DFILE_COOKIE &&
      f->funcs.read == read_memfile &&
      f->funcs.write == write_memfile &&
@@ -1404,7 +1735,6 @@ DFILE * d_fmemreopen(void * buf, size_t size, char const * _mode, DFILE * f) {
     if(!d_fmemopen_impl(buf, size, _mode, f))
       goto fail;
   }
-  reseat_dfile_list(oldflags, f);
   return f;
 
 fail:
@@ -1416,7 +1746,6 @@ fail:
 }
 
 DFILE * d_reopen_memstream(char ** buf, size_t * tell, DFILE * f) {
-  int oldflags = f->flags;
   if(f->flags & DFILE_COOKIE &&
      f->funcs.read == NULL &&
      f->funcs.write == write_memstream &&
@@ -1443,7 +1772,6 @@ DFILE * d_reopen_memstream(char ** buf, size_t * tell, DFILE * f) {
     if(!d_open_memstream_impl(buf, tell, f))
       goto fail;
   }
-  reseat_dfile_list(oldflags, f);
   return f;
 
 fail:
@@ -1455,7 +1783,6 @@ fail:
 }
 
 DFILE * d_reopen_strstream(char const * buf, DFILE * f) {
-  int oldflags = f->flags;
   if(f->flags & DFILE_COOKIE &&
      f->funcs.read == read_strstream &&
      f->funcs.write == NULL &&
@@ -1477,7 +1804,6 @@ DFILE * d_reopen_strstream(char const * buf, DFILE * f) {
     if(!d_open_strstream_impl(buf, f))
       goto fail;
   }
-  reseat_dfile_list(oldflags, f);
   return f;
 
 fail:
@@ -1488,10 +1814,10 @@ fail:
   return NULL;
 }
 
-int d_fwrite_unlocked(const void * ptr, int ct, DFILE * f) {
+static int dwrite_begin(DFILE * f) {
   assert(f->canary == DFILE_CANARY);
   if(!(f->flags & DFILE_WRITE)) {
-    f->flags |= DFILE_ERROR;
+    dset_flags(f, DFILE_ERROR);
     return -1;
   }
   if(f->num_ungets) {
@@ -1502,33 +1828,23 @@ int d_fwrite_unlocked(const void * ptr, int ct, DFILE * f) {
     if(d_fseek(f, 0, D_SEEK_END) < 0)
       return -1;
   }
+  return 0;
+}
 
-  int ret = 0;
-  while(ct) {
-    if(f->dirty_cursor == f->buf_size) {
-      if(d_fflush_unlocked(f) < 0)
-        break;
-    }
-    int nbytes = f->buf_size - f->dirty_cursor;
-    if(ct < nbytes) nbytes = ct;
-
-    memcpy(f->buf + f->dirty_cursor, ptr, nbytes);
-    ret += nbytes;
-    ct -= nbytes;
-    ptr += nbytes;
-    f->dirty_cursor += nbytes;
-  }
+// flushes per the buffering mode after bytes were added at start
+static int dwrite_end(DFILE * f, int start) {
   if(f->flags & DFILE_UNBUFFERED) {
     int ret = d_fflush_unlocked(f);
-    if(ret < 0) {
-      f->flags |= DFILE_ERROR;
+    if(ret < 0 && !dwould_block(f)) {
+      dset_flags(f, DFILE_ERROR);
       return ret;
     }
   }
   else if(f->flags & DFILE_LINE_BUFFERED) {
+    // anything before start had no newline or it'd have been flushed
     bool found = false;
     char * ptr = f->buf + f->dirty_cursor;
-    while(ptr --> f->buf) {
+    while(ptr --> f->buf + start) {
       if(*ptr == '\n') {
         found = true;
         break;
@@ -1536,19 +1852,167 @@ int d_fwrite_unlocked(const void * ptr, int ct, DFILE * f) {
     }
     if(found) {
       int ret = d_fflush_unlocked_impl(f, (char*)ptr - f->buf + 1);
-      if(ret < 0) {
-        f->flags |= DFILE_ERROR;
+      if(ret < 0 && !dwould_block(f)) {
+        dset_flags(f, DFILE_ERROR);
         return ret;
       }
     }
   }
+  if(f->dirty_cursor && !(f->flags & DFILE_SINK))
+    mark_dirty(f);
+  return 0;
+}
+
+__attribute__((visibility("hidden")))
+int d_fwrite_record_impl(DFILE * f, const void * ptr, int ct) {
+  if(f->flags & DFILE_SINK) {
+    // what doesn't fit is dropped, but still counts as written
+    size_t room = f->buf_size - f->dirty_cursor;
+    size_t nbytes = (size_t)ct < room ? (size_t)ct : room;
+    if(nbytes)
+      memcpy(f->buf + f->dirty_cursor, ptr, nbytes);
+    f->dirty_cursor += nbytes;
+    return ct;
+  }
+  if(dwrite_begin(f) < 0)
+    return -1;
+
+  int ret = 0;
+  int start = f->dirty_cursor;
+  while(ct) {
+    if((size_t)f->dirty_cursor == f->buf_size) {
+      // a nonblocking flush may still have made some room
+      start = 0;
+      if(d_fflush_unlocked(f) < 0 && (size_t)f->dirty_cursor == f->buf_size)
+        break;
+    }
+    int nbytes = f->buf_size - f->dirty_cursor;
+    if(ct < nbytes) nbytes = ct;
+
+    memcpy(f->buf + f->dirty_cursor, ptr, nbytes);
+    ret += nbytes;
+    ct -= nbytes;
+    ptr += nbytes;
+    f->dirty_cursor += nbytes;
+  }
+  if(!ret && ct)
+    return -1;
+  int ret2 = dwrite_end(f, start);
+  if(ret2 < 0)
+    return ret2;
   return ret;
 }
 
+// a deferred stream's records are written through record, anything
+// else written to it is wrapped in a record of its own by printf so
+// the decoder can pass it through
+__attribute__((visibility("hidden")))
+int d_fdeferred_raw_impl(DFILE * f, void const * ptr, int ct);
+
+int d_fwrite_unlocked(const void * ptr, int ct, DFILE * f) {
+  if(f->flags & DFILE_DEFERRED)
+    return d_fdeferred_raw_impl(f, ptr, ct);
+  return d_fwrite_record_impl(f, ptr, ct);
+}
+
+char * d_freserve_unlocked(DFILE * f, int ct) {
+  if(dwrite_begin(f) < 0)
+    return NULL;
+  // the bytes have to be wrapped in a record, which commit can't do
+  if(ct < 0 || (f->flags & DFILE_DEFERRED))
+    return NULL;
+  if((size_t)ct > f->buf_size - f->dirty_cursor) {
+    if((size_t)ct > f->buf_size || (f->flags & DFILE_SINK))
+      return NULL;
+    if(d_fflush_unlocked(f) < 0 && (size_t)ct > f->buf_size - f->dirty_cursor)
+      return NULL;
+  }
+  return f->buf + f->dirty_cursor;
+}
+
+// printf's scatter gather. between begin and end, writes through ref of
+// at least DFILE_GATHER_MIN bytes that don't fit in the buffer are
+// queued by reference instead of copied, so the memory has to last
+// until end, which writes out whatever was queued. only fully buffered fd streams gather. begin
+// returns the previous state for end to restore, so nested calls, or
+// a section with enable false, don't leave references behind
+__attribute__((visibility("hidden")))
+bool d_fgather_begin_impl(DFILE * f, bool enable) {
+  bool prev = f->gathering;
+#ifdef __linux__
+  f->gathering = enable &&
+    (f->flags & DFILE_WRITE) &&
+    !(f->flags & (DFILE_STRFILE | DFILE_COOKIE | DFILE_SINK | DFILE_NONBLOCK |
+                  DFILE_LINE_BUFFERED | DFILE_UNBUFFERED | DFILE_DEFERRED));
+#else
+  f->gathering = false;
+#endif
+  return prev;
+}
+__attribute__((visibility("hidden")))
+int d_fgather_end_impl(DFILE * f, bool prev) {
+  int ret = 0;
+#ifdef __linux__
+  if(f->gathering && f->num_gathered)
+    ret = dgather_flush(f);
+#endif
+  f->gathering = prev;
+  return ret;
+}
+__attribute__((visibility("hidden")))
+int d_fwrite_ref_impl(DFILE * f, char const * ptr, int ct) {
+  // what fits is buffered as usual, so calls that fit make no syscall
+  if(!f->gathering || ct < DFILE_GATHER_MIN || (size_t)ct <= f->buf_size - f->dirty_cursor)
+    return d_fwrite_unlocked(ptr, ct, f);
+  if(dwrite_begin(f) < 0)
+    return -1;
+  if(f->num_gathered == DFILE_GATHER && d_fflush_unlocked(f) < 0)
+    return -1;
+  f->gathered[f->num_gathered++] = (DFILE_PIECE) { ptr, ct, f->dirty_cursor };
+  return ct;
+}
+
+// snprintf's stream: a DFILE on the stack writing into buf, which is
+// never flushed and never registered anywhere. everything but
+// buf_storage is zeroed and the lock is initialized, so a custom
+// printer can treat it like any stream. the cursors are ints, so at
+// most INT_MAX - 1 bytes are kept. the output is nul terminated
+// within size
+__attribute__((visibility("hidden")))
+int d_fsink_impl(char * buf, size_t size, int (*fn)(DFILE * f, void * ctx), void * ctx) {
+  DFILE_STORAGE storage;
+  DFILE * f = &storage.f;
+  memset(f, 0, offsetof(DFILE, buf_storage));
+  memset(&f->num_ungets, 0, sizeof storage - offsetof(DFILE, num_ungets));
+  init_dflock(&storage.tail.lock);
+  if(size > INT_MAX)
+    size = INT_MAX;
+  f->canary = DFILE_CANARY;
+  f->fd = -1;
+  f->flags = DFILE_WRITE | DFILE_SINK | DFILE_USER_LOCKING;
+  f->buf = buf;
+  f->buf_size = size ? size - 1 : 0;
+  int ret = fn(f, ctx);
+  if(size)
+    buf[f->dirty_cursor] = '\0';
+  destroy_dflock(&storage.tail.lock);
+  return ret;
+}
+
+int d_fcommit_unlocked(DFILE * f, int ct) {
+  assert(ct >= 0 && (size_t)ct <= f->buf_size - f->dirty_cursor);
+  int start = f->dirty_cursor;
+  f->dirty_cursor += ct;
+  int ret = dwrite_end(f, start);
+  if(ret < 0)
+    return ret;
+  return ct;
+}
+
 static int dfbuffer(DFILE * f, int ct) {
   assert(f->canary == DFILE_CANARY);
   if(!(f->flags & DFILE_READ)) {
-    f->flags |= DFILE_ERROR;
+    dset_flags(f, DFILE_ERROR);
     return -1;
   }
   if(d_fflush_unlocked(f) < 0)
@@ -1577,10 +2041,18 @@ static int dfbuffer(DFILE * f, int ct) {
     while(ret < 0) {
       // relying on termios to not be retarded
       ret = read(f->fd, f->buf + f->buf_cursor, ct);
-      if(ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
-        return ret;
+      if(ret < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+          return ret;
+        if(f->flags & DFILE_NONBLOCK)
+          return ret;
+        dwait_fd(f->fd, false);
+      }
     }
   }
+  // a failed cookie read mustn't move the cursor back
+  if(ret < 0)
+    return ret;
   f->buf_cursor += ret;
   return ret;
 }
@@ -1588,7 +2060,7 @@ static int dfbuffer(DFILE * f, int ct) {
 int d_fread_unlocked(void * ptr, int ct, DFILE * f) {
   assert(f->canary == DFILE_CANARY);
   if(!(f->flags & DFILE_READ)) {
-    f->flags |= DFILE_ERROR;
+    dset_flags(f, DFILE_ERROR);
     return 0;
   }
 
@@ -1603,7 +2075,7 @@ int d_fread_unlocked(void * ptr, int ct, DFILE * f) {
     return nread;
   // dirty_cursor is now 0
   if(d_fflush_unlocked(f) < 0)
-    return 0;
+    return dwould_block(f) && !nread ? -1 : nread;
   while(ct) {
     if(f->buf_cursor) {
       int nbytes = ct < f->buf_cursor ? ct : f->buf_cursor;
@@ -1618,9 +2090,11 @@ int d_fread_unlocked(void * ptr, int ct, DFILE * f) {
       int bufret = dfbuffer(f, ct);
       if(bufret <= 0) {
         if(bufret == 0)
-          f->flags |= DFILE_EOF;
+          dset_flags(f, DFILE_EOF);
+        else if(dwould_block(f))
+          return nread ? nread : -1;
         else
-          f->flags |= DFILE_ERROR;
+          dset_flags(f, DFILE_ERROR);
         return nread;
       }
     }
@@ -1633,7 +2107,7 @@ char * d_fgets_unlocked(char * buf, int ct, DFILE * f) {
   char * ret = buf;
   bool any_read = false;
   if(!(f->flags & DFILE_READ)) {
-    f->flags |= DFILE_ERROR;
+    dset_flags(f, DFILE_ERROR);
     return NULL;
   }
   int nread = 0;
@@ -1680,9 +2154,11 @@ char * d_fgets_unlocked(char * buf, int ct, DFILE * f) {
       int bufret = dfbuffer(f, 1);
       if(bufret <= 0) {
         if(bufret == 0)
-          f->flags |= DFILE_EOF;
+          dset_flags(f, DFILE_EOF);
+        else if(dwould_block(f))
+          bufret = 0;
         else
-          f->flags |= DFILE_ERROR;
+          dset_flags(f, DFILE_ERROR);
         buf[0] = 0;
         return bufret < 0 ? NULL :
                any_read ? ret : NULL;
@@ -1807,44 +2283,102 @@ fail:
 }
 
 int d_ungetc(int c, DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   if(c == -1)
     goto failure;
   if(f->num_ungets < DFILE_UNGETS) {
     f->ungets[f->num_ungets++] = c;
-    f->flags &= ~DFILE_EOF;
+    dclear_flags(f, DFILE_EOF);
     goto success;
   }
   goto failure;
 success:
-  d_funlockfile(f);
+  unlock_dfile(f);
   return c;
 failure:
-  d_funlockfile(f);
+  unlock_dfile(f);
   return -1;
 }
 
 void d_flockfile(DFILE * f) {
-#ifdef _WIN64
-  EnterCriticalSection(&f->tail[0].lock);
-#else
-  pthread_mutex_lock(&f->tail[0].lock);
-#endif
+  dflock_lock(&f->tail[0].lock);
 }
 int d_ftrylockfile(DFILE * f) {
-#ifdef _WIN64
-  // wat.
-  return TryEnterCriticalSection(&f->tail[0].lock) ? 0 : -1;
-#else
-  return pthread_mutex_trylock(&f->tail[0].lock) ? -1 : 0;
-#endif
+  return dflock_trylock(&f->tail[0].lock) ? -1 : 0;
 }
 void d_funlockfile(DFILE * f) {
-#ifdef _WIN64
-  LeaveCriticalSection(&f->tail[0].lock);
-#else
-  pthread_mutex_unlock(&f->tail[0].lock);
-#endif
+  dflock_unlock(&f->tail[0].lock);
+}
+
+// for printf and scanf, which lock like the rest of the library
+__attribute__((visibility("hidden")))
+void d_flockfile_impl(DFILE * f) {
+  lock_dfile(f);
+}
+__attribute__((visibility("hidden")))
+void d_funlockfile_impl(DFILE * f) {
+  unlock_dfile(f);
+}
+
+int d_fsetdeferred(DFILE * f, int deferred) {
+  lock_dfile(f);
+  int ret = !!(f->flags & DFILE_DEFERRED);
+  if(deferred && !ret) {
+    f->deferred_formats = calloc(DFILE_DEFERRED_FORMATS, sizeof(DFILE_DEFERRED_FORMAT));
+    if(!f->deferred_formats)
+      ret = -1;
+    else
+      dset_flags(f, DFILE_DEFERRED);
+  } else if(!deferred && ret) {
+    dclear_flags(f, DFILE_DEFERRED);
+    clear_deferred_formats(f);
+  }
+  unlock_dfile(f);
+  return ret;
+}
+
+// for printf's deferred records. lookup reports whether the text of the
+// format with record id was already written to f, and gives back the
+// plan remembered with it.
+// remember takes ownership of plan, freeing the one it evicts, unless
+// f is no longer deferred
+__attribute__((visibility("hidden")))
+bool d_fdeferred_impl(DFILE * f) {
+  return __atomic_load_n(&f->flags, __ATOMIC_RELAXED) & DFILE_DEFERRED;
+}
+static DFILE_DEFERRED_FORMAT * deferred_slot(DFILE * f, uint64_t id) {
+  uint64_t h = id;
+  h = (h ^ (h >> 7) ^ (h >> 17)) % DFILE_DEFERRED_FORMATS;
+  return &f->deferred_formats[h];
+}
+__attribute__((visibility("hidden")))
+bool d_fdeferred_lookup_impl(DFILE * f, uint64_t id, d_fmt ** plan) {
+  // deferral may have been turned off since printf checked
+  if(!f->deferred_formats)
+    return false;
+  DFILE_DEFERRED_FORMAT * slot = deferred_slot(f, id);
+  if(slot->id != id)
+    return false;
+  *plan = slot->plan;
+  return true;
+}
+__attribute__((visibility("hidden")))
+bool d_fdeferred_remember_impl(DFILE * f, uint64_t id, d_fmt * plan) {
+  if(!f->deferred_formats)
+    return false;
+  DFILE_DEFERRED_FORMAT * slot = deferred_slot(f, id);
+  d_fmt_free(slot->plan);
+  *slot = (DFILE_DEFERRED_FORMAT) { id, plan };
+  return true;
+}
+
+int d_fsetlocking(DFILE * f, int type) {
+  int ret = f->flags & DFILE_USER_LOCKING ? D_FSETLOCKING_BYCALLER : D_FSETLOCKING_INTERNAL;
+  if(type == D_FSETLOCKING_BYCALLER)
+    dset_flags(f, DFILE_USER_LOCKING);
+  else if(type == D_FSETLOCKING_INTERNAL)
+    dclear_flags(f, DFILE_USER_LOCKING);
+  return ret;
 }
 
 //////////////////////////////////////////
@@ -1884,7 +2418,7 @@ int d_fputs_unlocked(char const * str, DFILE * f) {
 }
 
 int d_puts(char const * str) {
-  d_flockfile(dstdout);
+  lock_dfile(dstdout);
   int ret = d_fputs_unlocked(str, dstdout);
   if(ret < 0)
     goto failure;
@@ -1892,10 +2426,10 @@ int d_puts(char const * str) {
   if(ret2 < 0)
     goto failure;
 
-  d_funlockfile(dstdout);
+  unlock_dfile(dstdout);
   return ret + 1;
 failure:
-  d_funlockfile(dstdout);
+  unlock_dfile(dstdout);
   return -1;
 }
 
@@ -1905,38 +2439,54 @@ failure:
 
 #define IMPL_LOCKED_BASIC(T, name) \
   T d_ ## name(DFILE * f) { \
-    d_flockfile(f); \
+    lock_dfile(f); \
     T ret = d_ ## name ## _unlocked(f); \
-    d_funlockfile(f); \
+    unlock_dfile(f); \
     return ret; \
   }
-IMPL_LOCKED_BASIC(int, feof)
-IMPL_LOCKED_BASIC(int, ferror)
+// status queries are a single atomic read, no lock needed
+int d_feof(DFILE * f) {
+  return __atomic_load_n(&f->flags, __ATOMIC_RELAXED) & DFILE_EOF;
+}
+int d_ferror(DFILE * f) {
+  return __atomic_load_n(&f->flags, __ATOMIC_RELAXED) & DFILE_ERROR;
+}
 void d_clearerror(DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   d_clearerror_unlocked(f);
-  d_funlockfile(f);
+  unlock_dfile(f);
 }
 
-IMPL_LOCKED_BASIC(int, fileno)
-IMPL_LOCKED_BASIC(int, fflush)
+int d_fileno(DFILE * f) {
+  return __atomic_load_n(&f->fd, __ATOMIC_RELAXED);
+}
+int d_fflush(DFILE * f) {
+  if(!f)
+    return flush_dfile_list(false);
+  lock_dfile(f);
+  int ret = d_fflush_unlocked(f);
+  unlock_dfile(f);
+  return ret;
+}
+IMPL_LOCKED_BASIC(int, fpending_write)
+IMPL_LOCKED_BASIC(int, fbuffered_read)
 
 int d_fwrite(const void * ptr, int ct, DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   int ret = d_fwrite_unlocked(ptr, ct, f);
-  d_funlockfile(f);
+  unlock_dfile(f);
   return ret;
 }
 int d_fread(void * ptr, int ct, DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   int ret = d_fread_unlocked(ptr, ct, f);
-  d_funlockfile(f);
+  unlock_dfile(f);
   return ret;
 }
 char * d_fgets(char * ptr, int ct, DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   char * ret = d_fgets_unlocked(ptr, ct, f);
-  d_funlockfile(f);
+  unlock_dfile(f);
   return ret;
 }
 
@@ -1947,15 +2497,15 @@ int d_getchar() {
 }
 
 int d_fputc(int c, DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   int ret = d_fputc_unlocked(c, f);
-  d_funlockfile(f);
+  unlock_dfile(f);
   return ret;
 }
 int d_putc(int c, DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   int ret = d_putc_unlocked(c, f);
-  d_funlockfile(f);
+  unlock_dfile(f);
   return ret;
 }
 int d_putchar(int c) {
@@ -1963,9 +2513,9 @@ int d_putchar(int c) {
 }
 
 int d_fputs(char const * ptr, DFILE * f) {
-  d_flockfile(f);
+  lock_dfile(f);
   int ret = d_fputs_unlocked(ptr, f);
-  d_funlockfile(f);
+  unlock_dfile(f);
   return ret;
 }
 
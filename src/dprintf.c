@@ -20,14 +20,43 @@
  */
 #include <stdarg.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "dfile.h"
 #include "dprintf.h"
 #include "dragonbox.h"
 
+__attribute__((visibility("hidden")))
+void d_flockfile_impl(DFILE * f);
+__attribute__((visibility("hidden")))
+void d_funlockfile_impl(DFILE * f);
+__attribute__((visibility("hidden")))
+int d_fsink_impl(char * buf, size_t size, int (*fn)(DFILE * f, void * ctx), void * ctx);
+__attribute__((visibility("hidden")))
+bool d_fgather_begin_impl(DFILE * f, bool enable);
+__attribute__((visibility("hidden")))
+int d_fgather_end_impl(DFILE * f, bool prev);
+__attribute__((visibility("hidden")))
+int d_fwrite_ref_impl(DFILE * f, char const * ptr, int ct);
+__attribute__((visibility("hidden")))
+bool d_fdeferred_impl(DFILE * f);
+__attribute__((visibility("hidden")))
+bool d_fdeferred_lookup_impl(DFILE * f, uint64_t id, d_fmt ** plan);
+__attribute__((visibility("hidden")))
+bool d_fdeferred_remember_impl(DFILE * f, uint64_t id, d_fmt * plan);
+__attribute__((visibility("hidden")))
+int d_fwrite_record_impl(DFILE * f, void const * ptr, int ct);
+__attribute__((visibility("hidden")))
+size_t d_base64_encode_impl(char * dst, unsigned char const * src, size_t n);
+
 static int scan_unsigned(char const ** pfmt) {
   char const * fmt = *pfmt;
   char c;
@@ -43,8 +72,9 @@ static int scan_unsigned(char const ** pfmt) {
   return u;
 }
 
-__attribute__((visibility("hidden")))
-print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_scan) {
+// parses a specifier without touching the arguments: * widths and
+// precisions are left as flags for resolve_print_specifier
+static print_specifier parse_print_specifier_raw(char const * fmt, bool is_scan) {
   int print_kind = PRINT_INCOMPLETE;
   int flags = 0;
   char const * start = fmt;
@@ -54,12 +84,16 @@ print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_s
     switch(c) {
     case '-':
       flags |= PRINT_LEFT_JUSTIFY;
+      break;
     case '+':
       flags |= PRINT_SIGN;
+      break;
     case ' ':
       flags |= PRINT_SPACE;
+      break;
     case '#':
       flags |= PRINT_ALTER;
+      break;
     case '0':
       flags |= PRINT_ZERO_EXTEND;
       break;
@@ -85,19 +119,18 @@ print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_s
     field_width = scan_unsigned(&fmt);
   else if(!is_scan && *fmt == '*') {
     fmt++;
-    field_width = va_arg(*args, int);
+    flags |= PRINT_WIDTH_ARG;
   }
 
-  bool precision_set = false;
-  int precision = 0;
+  // precision is -1 when unset
+  int precision = -1;
   if(fmt[0] == '.') {
-    precision_set = true;
     if('0' <= fmt[1] && fmt[1] <= '9') {
       fmt++;
       precision = scan_unsigned(&fmt);
     } else if(fmt[1] == '*') {
       fmt+=2;
-      precision = va_arg(*args, int);
+      flags |= PRINT_PRECISION_ARG;
     } else if(fmt[1] == '#') {
       fmt+=2;
       precision = 0;
@@ -169,6 +202,9 @@ print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_s
     case 's':
       print_kind = PRINT_STRING;
       break;
+    case 'S':
+      print_kind = is_scan ? PRINT_MALFORMED : PRINT_SLICE;
+      break;
     case 'i':
     case 'd':
       print_kind = PRINT_INT;
@@ -192,29 +228,36 @@ print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_s
     case 'f':
     case 'F':
       if(c < 'a') flags |= PRINT_ALLCAPS;
-      if(!(flags & PRINT_ROUNDTRIP) && !precision_set) precision = 6;
       print_kind = PRINT_DOUBLE;
       break;
     case 'g':
     case 'G':
       if(c < 'a') flags |= PRINT_ALLCAPS;
-      if(!precision_set) precision = 6;
       print_kind = PRINT_GENERAL;
       break;
     case 'a':
     case 'A':
       if(c < 'a') flags |= PRINT_ALLCAPS;
-      if(!precision_set) flags |= PRINT_ROUNDTRIP;
       print_kind = PRINT_HEXPONENT;
       break;
     case 'e':
     case 'E':
       if(c < 'a') flags |= PRINT_ALLCAPS;
-      if(!(flags & PRINT_ROUNDTRIP) && !precision_set) precision = 6;
       print_kind = PRINT_EXPONENT;
       break;
     case 'p':
       print_kind = PRINT_POINTER;
+      // %*pH, %*pD and %*pB print the buffer instead of the pointer
+      if(!is_scan && *fmt == 'H') {
+        print_kind = PRINT_HEXBUF;
+        fmt++;
+      } else if(!is_scan && *fmt == 'D') {
+        print_kind = PRINT_HEXDUMP;
+        fmt++;
+      } else if(!is_scan && *fmt == 'B') {
+        print_kind = PRINT_BASE64;
+        fmt++;
+      }
       break;
     case 'n':
       print_kind = PRINT_TELL;
@@ -231,6 +274,11 @@ print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_s
         label_end = fmt++;
       else
         print_kind = PRINT_MALFORMED;
+      // built in labels, ahead of anything registered
+      if(!is_scan && label_end - label == 4 && !memcmp(label, "json", 4))
+        print_kind = PRINT_JSON;
+      else if(!is_scan && label_end - label == 4 && !memcmp(label, "time", 4))
+        print_kind = PRINT_TIME;
       break;
     case '[':
       print_kind = SCAN_SET;
@@ -253,11 +301,70 @@ print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_s
       break;
   }
 
+  return (print_specifier) {
+    .print_kind = print_kind,
+    .kind_width = kind_width,
+    .kind_exact_width = kind_exact_width,
+    .precision = precision,
+    .field_width = field_width,
+    .flags = flags,
+    .chars_consumed = fmt - start,
+    .label = label,
+    .label_end = label_end,
+  };
+}
+
+static bool is_buffer_kind(int print_kind) {
+  return print_kind == PRINT_HEXBUF || print_kind == PRINT_HEXDUMP || print_kind == PRINT_BASE64;
+}
+
+// fetches * arguments and fills in the defaults that depend on them
+// width and precision are the * arguments, if the specifier has them
+static void resolve_print_specifier_args(print_specifier * specifier, int width, int precision) {
+  // for buffers the width is the length, which isn't a justification.
+  // with no width at all it's 1 byte, as for the kernel's %ph
+  if(is_buffer_kind(specifier->print_kind)) {
+    if(width < 0)
+      width = 0;
+    if(!(specifier->flags & PRINT_WIDTH_ARG) && specifier->field_width < 0)
+      specifier->field_width = 1;
+  }
+  if(specifier->flags & PRINT_WIDTH_ARG) {
+    specifier->field_width = width;
+    if(specifier->field_width < 0) {
+      specifier->flags |= PRINT_LEFT_JUSTIFY;
+      specifier->field_width = -specifier->field_width;
+    }
+  }
+  if(specifier->flags & PRINT_PRECISION_ARG) {
+    specifier->precision = precision;
+    if(specifier->precision < 0)
+      specifier->precision = -1;
+  }
+
+  int flags = specifier->flags;
+  bool precision_set = specifier->precision >= 0;
+  switch(specifier->print_kind) {
+    case PRINT_DOUBLE:
+    case PRINT_EXPONENT:
+      if(!precision_set) specifier->precision = flags & PRINT_ROUNDTRIP ? 0 : 6;
+      break;
+    case PRINT_GENERAL:
+      if(!precision_set) specifier->precision = 6;
+      break;
+    case PRINT_HEXPONENT:
+      if(!precision_set) {
+        flags |= PRINT_ROUNDTRIP;
+        specifier->precision = 0;
+      }
+      break;
+  }
+
   // unsetting flags specified to be unset in situations
   if(flags & PRINT_LEFT_JUSTIFY)
     flags &= ~PRINT_ZERO_EXTEND;
   if(precision_set) {
-    switch(print_kind) {
+    switch(specifier->print_kind) {
       case PRINT_BINARY:
       case PRINT_OCTAL:
       case PRINT_INT:
@@ -267,276 +374,539 @@ print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_s
         flags &= ~PRINT_ZERO_EXTEND;
     }
   }
+  specifier->flags = flags;
+}
 
-  return (print_specifier) {
-    .print_kind = print_kind,
-    .kind_width = kind_width,
-    .kind_exact_width = kind_exact_width,
-    .precision = precision,
-    .field_width = field_width,
-    .flags = flags,
-    .chars_consumed = fmt - start,
-    .label = label,
-    .label_end = label_end,
-  };
+static void resolve_print_specifier(print_specifier * specifier, va_list * args) {
+  int width = specifier->flags & PRINT_WIDTH_ARG ? va_arg(*args, int) : 0;
+  int precision = specifier->flags & PRINT_PRECISION_ARG ? va_arg(*args, int) : 0;
+  resolve_print_specifier_args(specifier, width, precision);
+}
+
+__attribute__((visibility("hidden")))
+print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_scan) {
+  print_specifier specifier = parse_print_specifier_raw(fmt, is_scan);
+  resolve_print_specifier(&specifier, args);
+  return specifier;
+}
+
+static char const digit_pairs[200] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+static uint64_t const powers_of_ten[20] = {
+  1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull,
+  10000000ull, 100000000ull, 1000000000ull, 10000000000ull,
+  100000000000ull, 1000000000000ull, 10000000000000ull,
+  100000000000000ull, 1000000000000000ull, 10000000000000000ull,
+  100000000000000000ull, 1000000000000000000ull, 10000000000000000000ull,
+};
+
+static int count_digits10(uint64_t u) {
+  // from the bit length, the digit count is known to within one.
+  // or-ing in 1 makes 0 one digit without changing any other count
+  u |= 1;
+  int bits = 64 - __builtin_clzll(u);
+  int guess = bits * 1233 >> 12;
+  return guess + 1 - (u < powers_of_ten[guess]);
 }
 
+// writes the digits back to front two at a time, so they land in order
 static int u64toa10(uint64_t u, char buf[static 21]) {
-  if(u == 0) {
-    buf[0] = '0';
-    buf[1] = '\0';
-    return 1;
+  int len = count_digits10(u);
+  char * ptr = buf + len;
+  *ptr = '\0';
+  while(u >= 100) {
+    int rem = u % 100;
+    u /= 100;
+    ptr -= 2;
+    memcpy(ptr, digit_pairs + 2*rem, 2);
   }
-  int idx = 0;
-  while(u) {
-    buf[idx++] = (u % 10) + '0';
-    u /= 10;
+  if(u >= 10)
+    memcpy(ptr - 2, digit_pairs + 2*u, 2);
+  else
+    ptr[-1] = '0' + u;
+  return len;
+}
+// base is 2, 8 or 16
+static int u64toa(uint64_t u, char buf[static 65], int base, bool allcaps) {
+  char const * digits = allcaps ? "0123456789ABCDEF" : "0123456789abcdef";
+  int shift = base == 16 ? 4 : base == 8 ? 3 : 1;
+  int mask = base - 1;
+  int bits = 64 - __builtin_clzll(u | 1);
+  int len = (bits + shift - 1) / shift;
+  char * ptr = buf + len;
+  *ptr = '\0';
+  while(ptr > buf) {
+    *--ptr = digits[u & mask];
+    u >>= shift;
   }
-  buf[idx] = '\0';
-  
-  char * start = buf;
-  char * end = buf + idx - 1;
-  while(start < end) {
-    char tmp = *start;
-    *start = *end;
-    *end = tmp;
-    start++;
-    end--;
+  return len;
+}
+
+// a conversion's output in order. the fill for the field width goes
+// before all of it, after the prefix as zeroes, or after all of it
+typedef struct print_layout {
+  char const * prefix;
+  int prefix_len;
+  int zeroes;
+  char const * body;
+  int body_len;
+  int trailing_zeroes;
+  char const * suffix;
+  int suffix_len;
+} print_layout;
+
+static char * put_bytes(char * dst, char const * src, int len) {
+  if(len)
+    memcpy(dst, src, len);
+  return dst + len;
+}
+static char * put_fill(char * dst, char c, int len) {
+  if(len > 0)
+    memset(dst, c, len);
+  return dst + (len > 0 ? len : 0);
+}
+
+static int write_fill(DFILE * f, char c, int len) {
+  enum { FILL = 64 };
+  char fill[FILL];
+  put_fill(fill, c, len < FILL ? len : FILL);
+  while(len > 0) {
+    int n = len < FILL ? len : FILL;
+    if(d_fwrite_unlocked(fill, n, f) != n)
+      return -1;
+    len -= n;
   }
-  return idx;
+  return 0;
 }
-static int u64toa(uint64_t u, char buf[static 65], int base, bool allcaps) {
-  if(u == 0) {
-    buf[0] = '0';
-    buf[1] = '\0';
-    return 1;
+
+static int print_layout_out(DFILE * f, print_specifier specifier, print_layout const * l) {
+  int len = l->prefix_len + l->zeroes + l->body_len + l->trailing_zeroes + l->suffix_len;
+  int fill = specifier.field_width > len ? specifier.field_width - len : 0;
+  int left = 0, zeroes = l->zeroes, right = 0;
+  if(specifier.flags & PRINT_LEFT_JUSTIFY)
+    right = fill;
+  else if(specifier.flags & PRINT_ZERO_EXTEND)
+    zeroes += fill;
+  else
+    left = fill;
+  int total = len + fill;
+
+  char * buf = d_freserve_unlocked(f, total);
+  if(buf) {
+    buf = put_fill(buf, ' ', left);
+    buf = put_bytes(buf, l->prefix, l->prefix_len);
+    buf = put_fill(buf, '0', zeroes);
+    buf = put_bytes(buf, l->body, l->body_len);
+    buf = put_fill(buf, '0', l->trailing_zeroes);
+    buf = put_bytes(buf, l->suffix, l->suffix_len);
+    put_fill(buf, ' ', right);
+    return d_fcommit_unlocked(f, total) < 0 ? -1 : total;
   }
-  int idx = 0;
-  char a = allcaps ? 'A' : 'a';
-  while(u) {
-    int rem = (u % base);
-    buf[idx++] = rem < 10 ? rem + '0' : rem - 10 + a;
-    u /= base;
-  }
-  buf[idx] = '\0';
-  
-  char * start = buf;
-  char * end = buf + idx - 1;
-  while(start < end) {
-    char tmp = *start;
-    *start = *end;
-    *end = tmp;
-    start++;
-    end--;
-  }
-  return idx;
-}
-
-static uint64_t truncu(uint64_t u, int * e, int precision) {
-  if(*e > 0)
-    return u;
-  int last = 0;
-  int lastlast = 0;
-  while(-*e > precision) {
-    lastlast += last;
-    last = u % 10;
-    u = u / 10;
-    (*e)++;
-  }
-  if(last > 5 || (last == 5 && (lastlast || ((u % 10) & 1))))
-    u += 1;
-  return u;
+
+  // wider than the stream's buffer, so it goes out in pieces
+  if(write_fill(f, ' ', left) < 0
+     || d_fwrite_unlocked(l->prefix, l->prefix_len, f) != l->prefix_len
+     || write_fill(f, '0', zeroes) < 0
+     || d_fwrite_unlocked(l->body, l->body_len, f) != l->body_len
+     || write_fill(f, '0', l->trailing_zeroes) < 0
+     || d_fwrite_unlocked(l->suffix, l->suffix_len, f) != l->suffix_len
+     || write_fill(f, ' ', right) < 0)
+    return -1;
+  return total;
+}
+
+// body with precision zeroes in front, for the integer conversions
+static int print_number(DFILE * f, char const * prefix, int prefix_len, char const * number, int len, print_specifier specifier) {
+  print_layout l = {
+    .prefix = prefix,
+    .prefix_len = prefix_len,
+    .zeroes = specifier.precision > len ? specifier.precision - len : 0,
+    .body = number,
+    .body_len = len,
+  };
+  return print_layout_out(f, specifier, &l);
 }
 
-static int dtoaz(dragonbox dragon, char buf[static 2048], int * decimal) {
-  char * og = buf;
-  uint64_t u = dragon.significand;
-  int e = dragon.exponent;
-  char tmp[21];
-  int ret = 0;
-  int len = u64toa10(u, tmp);
-  *decimal = 0;
-  if(-e >= len) {
-    *buf++ = '0';
-    *buf++ = '.';
-    *decimal = -e;
-    ret = 2;
-  }
-  while(-e > len) {
-    *buf++ = '0';
-    e++;
-    ret++;
-  }
-  for(int i = 0; i < len; i++) {
-    if(i - len == e && i != 0) {
-      *buf++ = '.';
-      *decimal = -e;
-      ret++;
+// exact binary to decimal for the fixed precision conversions. a double
+// is m * 2^e, so its expansion has at most 309 integer digits and -e
+// fraction digits, and the digits past any cut can be summarized as
+// zero, below half, exactly half or above half for rounding
+enum { REST_ZERO, REST_BELOW, REST_HALF, REST_ABOVE };
+
+// enough for 1074 fraction bits after multiplying by 10^9, or 1024
+// integer bits
+enum { BIG_LIMBS = 36 };
+
+static int exact_integer_digits(uint64_t m, int e, char * buf) {
+  if(e <= 0)
+    return u64toa10(-e < 64 ? m >> -e : 0, buf);
+  if(e < __builtin_clzll(m))
+    return u64toa10(m << e, buf);
+
+  uint32_t big[BIG_LIMBS] = { 0 };
+  int len = e / 32;
+  uint64_t lo = m << (e % 32);
+  uint64_t hi = e % 32 ? m >> (64 - e % 32) : 0;
+  big[len++] = lo;
+  big[len++] = lo >> 32;
+  big[len++] = hi;
+  while(len && !big[len-1])
+    len--;
+
+  // peel off nine digits at a time, least significant first
+  uint32_t chunks[BIG_LIMBS];
+  int nchunks = 0;
+  while(len) {
+    uint64_t rem = 0;
+    for(int i = len; i--;) {
+      uint64_t cur = rem << 32 | big[i];
+      big[i] = cur / 1000000000;
+      rem = cur % 1000000000;
     }
-    *buf++ = tmp[i];
-    ret++;
+    chunks[nchunks++] = rem;
+    while(len && !big[len-1])
+      len--;
   }
-  while(e > 0) {
-    *buf++ = '0';
-    e--;
-    ret++;
+  int ret = u64toa10(chunks[--nchunks], buf);
+  while(nchunks--) {
+    uint32_t chunk = chunks[nchunks];
+    for(int i = 9; i--;) {
+      buf[ret + i] = '0' + chunk % 10;
+      chunk /= 10;
+    }
+    ret += 9;
   }
-
   return ret;
 }
 
-static int print_number(DFILE * f, const char prefix[], const char number[], int len, print_specifier specifier, int nzeroes) {
-  int ret = 0;
-  int prefixlen = strlen(prefix);
-  if(prefixlen && (specifier.flags & PRINT_ZERO_EXTEND))
-    d_fwrite_unlocked(prefix, prefixlen, f);
-  ret += prefixlen;
+// writes the first nfrac fraction digits and returns what's past them
+static int exact_fraction_digits(uint64_t m, int e, int nfrac, char * buf) {
+  if(e >= 0) {
+    memset(buf, '0', nfrac);
+    return REST_ZERO;
+  }
+  int s = -e;
+  if(s <= 60) {
+    uint64_t mask = (1ull << s) - 1;
+    uint64_t frac = m & mask;
+    for(int i = 0; i < nfrac; i++) {
+      frac *= 10;
+      buf[i] = '0' + (frac >> s);
+      frac &= mask;
+    }
+    uint64_t half = 1ull << (s - 1);
+    return !frac ? REST_ZERO : frac < half ? REST_BELOW : frac == half ? REST_HALF : REST_ABOVE;
+  }
 
-  char fill = specifier.flags & PRINT_ZERO_EXTEND ? '0' : ' ';
-  int fill_len = specifier.field_width - len - strlen(prefix) - nzeroes;
-  if(!(specifier.flags & PRINT_LEFT_JUSTIFY)) {
-    for(int i = 0; i < fill_len; i++)
-      d_fputc_unlocked(fill, f);
+  // m < 2^53 is all fraction here
+  uint32_t big[BIG_LIMBS] = { m, m >> 32 };
+  int len = s / 32 + 2;
+  int idx = s / 32, sh = s % 32;
+  static uint32_t const pow10[10] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000,
+  };
+  for(int i = 0; i < nfrac; i += 9) {
+    int k = nfrac - i < 9 ? nfrac - i : 9;
+    uint64_t carry = 0;
+    for(int j = 0; j < len; j++) {
+      uint64_t cur = (uint64_t)big[j] * pow10[k] + carry;
+      big[j] = cur;
+      carry = cur >> 32;
+    }
+    // the k digits are whatever rose above bit s
+    uint32_t chunk = big[idx] >> sh;
+    if(sh)
+      chunk |= big[idx+1] << (32 - sh);
+    big[idx] &= (1u << sh) - 1;
+    big[idx+1] = 0;
+    for(int j = k; j--;) {
+      buf[i + j] = '0' + chunk % 10;
+      chunk /= 10;
+    }
   }
-  ret += fill_len > 0 ? fill_len : 0;
 
-  if(prefixlen && !(specifier.flags & PRINT_ZERO_EXTEND))
-    d_fwrite_unlocked(prefix, prefixlen, f);
+  int hidx = (s - 1) / 32;
+  uint32_t hbit = 1u << (s - 1) % 32;
+  bool half = big[hidx] & hbit;
+  bool below = big[hidx] & ~hbit;
+  for(int j = 0; j < hidx; j++)
+    below |= big[j] != 0;
+  return half ? (below ? REST_ABOVE : REST_HALF) : (below ? REST_BELOW : REST_ZERO);
+}
+
+// what the digits past a cut amount to, followed by rest
+static int fold_rest(char const * digits, int n, int rest) {
+  if(!n)
+    return rest;
+  int d = digits[0] - '0';
+  if(d > 5)
+    return REST_ABOVE;
+  bool nonzero = rest != REST_ZERO;
+  for(int i = 1; i < n && !nonzero; i++)
+    nonzero = digits[i] != '0';
+  if(d == 5)
+    return nonzero ? REST_ABOVE : REST_HALF;
+  return d || nonzero ? REST_BELOW : REST_ZERO;
+}
 
-  ret += nzeroes;
-  while(nzeroes--)
-    d_fputc_unlocked('0', f);
+// round half to even. returns true if the digits carried out to all zeroes
+static bool round_digits(char * digits, int n, int rest) {
+  if(!(rest == REST_ABOVE || (rest == REST_HALF && (digits[n-1] & 1))))
+    return false;
+  for(int i = n; i--;) {
+    if(digits[i] != '9') {
+      digits[i]++;
+      return false;
+    }
+    digits[i] = '0';
+  }
+  return true;
+}
 
-  d_fwrite_unlocked(number, len, f);
-  ret += len;
+// digits of m * 2^e with prec digits after the point, including the
+// point. only digits that can be nonzero are written, nzeroes is the
+// count of zeroes that should follow
+static int exact_fixed(uint64_t m, int e, int prec, char * buf, int * nzeroes) {
+  int ilen = exact_integer_digits(m, e, buf);
+  int nfrac = e < 0 && -e < prec ? -e : prec;
+  if(e >= 0)
+    nfrac = 0;
+  int rest = exact_fraction_digits(m, e, nfrac, buf + ilen);
+  if(round_digits(buf, ilen + nfrac, rest)) {
+    memmove(buf + 1, buf, ilen + nfrac);
+    buf[0] = '1';
+    ilen++;
+  }
+  memmove(buf + ilen + 1, buf + ilen, nfrac);
+  buf[ilen] = '.';
+  *nzeroes = prec - nfrac;
+  return ilen + 1 + nfrac;
+}
 
-  if(specifier.flags & PRINT_LEFT_JUSTIFY) {
-    for(int i = 0; i < fill_len; i++)
-      d_fputc_unlocked(fill, f);
+// the first sig significant digits of m * 2^e, rounded, and the
+// decimal exponent of the first. digits past the returned count are
+// zeroes
+static int exact_significant(uint64_t m, int e, int sig, char * buf, int * exp10) {
+  if(!m) {
+    buf[0] = '0';
+    *exp10 = 0;
+    return 1;
+  }
+  // no double has more than 767 significant digits
+  int want = sig < 800 ? sig : 800;
+  int s = e < 0 ? -e : 0;
+  int n, rest;
+  int ilen = exact_integer_digits(m, e, buf);
+  if(buf[0] != '0') {
+    *exp10 = ilen - 1;
+    int nfrac = want > ilen ? want - ilen : 0;
+    if(nfrac > s)
+      nfrac = s;
+    rest = exact_fraction_digits(m, e, nfrac, buf + ilen);
+    n = ilen + nfrac;
+  } else {
+    // the value is at least 2^(b-1), which bounds the leading zeroes.
+    // the bound may be one high, the extra digit is folded in below
+    int b = 64 - __builtin_clzll(m) + e;
+    int zeroes = -((b - 1) * 1233 >> 12);
+    int nfrac = zeroes + want;
+    if(nfrac > s)
+      nfrac = s;
+    rest = exact_fraction_digits(m, e, nfrac, buf);
+    int first = 0;
+    while(buf[first] == '0')
+      first++;
+    *exp10 = -(first + 1);
+    n = nfrac - first;
+    memmove(buf, buf + first, n);
   }
+  if(n > want) {
+    rest = fold_rest(buf + want, n - want, rest);
+    n = want;
+  }
+  if(round_digits(buf, n, rest)) {
+    buf[0] = '1';
+    (*exp10)++;
+  }
+  return n;
+}
 
-  return ret;
+// d.ddde+xx from n significant digits, padded to prec fraction digits
+static int render_exponent(char const * digits, int n, int exp10, int prec, bool alter, bool allcaps, char * buf, int * nzeroes, char * suffix, int * suffix_len) {
+  int len = 0;
+  buf[len++] = digits[0];
+  if(n > 1 || prec > 0 || alter)
+    buf[len++] = '.';
+  memcpy(buf + len, digits + 1, n - 1);
+  len += n - 1;
+  *nzeroes = prec > n - 1 ? prec - (n - 1) : 0;
+
+  int slen = 0;
+  suffix[slen++] = allcaps ? 'E' : 'e';
+  suffix[slen++] = exp10 < 0 ? '-' : '+';
+  if(exp10 < 0)
+    exp10 = -exp10;
+  if(exp10 < 10)
+    suffix[slen++] = '0';
+  slen += u64toa10(exp10, suffix + slen);
+  *suffix_len = slen;
+  return len;
 }
 
-static int get_exponent(dragonbox dragon, int * dragonexp) {
-  int exponent = dragon.exponent;
-  int dragon_exponent = 0;
-  uint64_t u = dragon.significand;
-  while(u > 9) {
-    u /= 10;
-    exponent++;
-    dragon_exponent--;
+// ddd.ddd from n significant digits, padded to prec fraction digits
+static int render_fixed(char const * digits, int n, int exp10, int prec, bool alter, char * buf, int * nzeroes) {
+  int len = 0;
+  int nfrac;
+  if(exp10 >= 0) {
+    int nint = n < exp10 + 1 ? n : exp10 + 1;
+    memcpy(buf, digits, nint);
+    len = nint;
+    memset(buf + len, '0', exp10 + 1 - nint);
+    len += exp10 + 1 - nint;
+    nfrac = n - nint;
+    if(nfrac || prec > 0 || alter)
+      buf[len++] = '.';
+    memcpy(buf + len, digits + nint, nfrac);
+    len += nfrac;
+  } else {
+    buf[len++] = '0';
+    buf[len++] = '.';
+    memset(buf + len, '0', -exp10 - 1);
+    len += -exp10 - 1;
+    memcpy(buf + len, digits, n);
+    len += n;
+    nfrac = -exp10 - 1 + n;
   }
-  if(dragonexp)
-    *dragonexp = dragon_exponent;
-  return exponent;
+  *nzeroes = prec > nfrac ? prec - nfrac : 0;
+  return len;
 }
 
-static int print_double(DFILE * f, print_specifier specifier, va_list * args) {
-  double d;
+// largest body: 309 integer digits, a point and 1074 fraction digits
+enum { DOUBLE_BUF = 1400 };
+
+// h, w32 and wf32 on a float conversion mean the argument was a float
+static bool is_float_width(print_specifier specifier) {
   switch(specifier.kind_width) {
-  case PRINT_LONGLONG:
-    d = va_arg(*args, long double);
-    break;
-  default:
-    d = va_arg(*args, double);
+    case PRINT_SHORT:
+      return true;
+    case PRINT_EXACT:
+    case PRINT_FAST:
+      return specifier.kind_exact_width == 32;
+    default:
+      return false;
   }
-  char buf[2048];
-  int len;
+}
+
+// is_float only changes the roundtrip digits: any float is exactly a
+// double, so fixed precisions print the same either way
+static int print_double_value(DFILE * f, print_specifier specifier, double d, bool is_float) {
+  uint64_t u;
+  memcpy(&u, &d, sizeof d);
 
-  char sign[2] = {0};
-  if(d < 0)
-    sign[0] = '-';
+  char sign[1];
+  int sign_len = 0;
+  if(u >> 63)
+    sign[sign_len++] = '-';
   else if(specifier.flags & PRINT_SIGN)
-    sign[0] = '+';
+    sign[sign_len++] = '+';
   else if(specifier.flags & PRINT_SPACE)
-    sign[0] = ' ';
+    sign[sign_len++] = ' ';
 
-  int decimal = 0;
-  char suffix[32] = "";
+  bool allcaps = specifier.flags & PRINT_ALLCAPS;
+  bool alter = specifier.flags & PRINT_ALTER;
+  int prec = specifier.precision;
+  char buf[DOUBLE_BUF];
+  char digits[DOUBLE_BUF];
+  char suffix[32];
+  int suffix_len = 0;
+  int len, nzeroes = 0;
 
-  uint64_t u;
-  memcpy(&u, &d, sizeof d);
   enum { EXP = (1 << 11) - 1, MANT = (1ull << 52) - 1, };
-  if(((u >> 52) & EXP) == EXP) {
-    if(u & MANT) {
-      len = 3;
-      memcpy(buf, specifier.flags & PRINT_ALLCAPS ? "NAN" : "nan", 4);
-      specifier.flags |= PRINT_ROUNDTRIP;
-      specifier.precision = 0;
-    } else {
-      len = 3;
-      memcpy(buf, specifier.flags & PRINT_ALLCAPS ? "INF" : "inf", 4);
-      specifier.flags |= PRINT_ROUNDTRIP;
-      specifier.precision = 0;
-    }
+  uint64_t raw_exp = (u >> 52) & EXP;
+  if(raw_exp == EXP) {
+    len = 3;
+    if(u & MANT)
+      memcpy(buf, allcaps ? "NAN" : "nan", 3);
+    else
+      memcpy(buf, allcaps ? "INF" : "inf", 3);
     specifier.flags &= ~PRINT_ZERO_EXTEND;
-    specifier.flags &= ~PRINT_ALTER;
-  }
-  else if(d == 0) {
-    len = 0;
-    buf[len++] = '0';
-    decimal = 0;
-    buf[len] = '\0';
-  } else {
-    dragonbox dragon = dtodragon(d);
-    bool print_exponent = specifier.print_kind == PRINT_EXPONENT;
+  } else if(specifier.flags & PRINT_ROUNDTRIP) {
+    // the shortest digits that read back as d, padded to the precision
+    int n = 1, exp10 = 0;
+    digits[0] = '0';
+    if(d != 0) {
+      dragonbox dragon = is_float ? ftodragon(d) : dtodragon(d);
+      n = u64toa10(dragon.significand, digits);
+      exp10 = dragon.exponent + n - 1;
+    }
+    bool exponent = specifier.print_kind == PRINT_EXPONENT;
     if(specifier.print_kind == PRINT_GENERAL) {
-      int exponent = get_exponent(dragon, NULL);
-      if(-4 <= exponent && exponent < specifier.precision) {
-        print_exponent = false;
-        specifier.precision = specifier.precision - exponent - 1;
-      } else {
-        print_exponent = true;
-        specifier.precision = specifier.precision - 1;
-      }
-      if(specifier.precision < 0) specifier.precision = 0;
+      int p = prec ? prec : 1;
+      exponent = !(-4 <= exp10 && exp10 < p);
+      prec = alter ? (exponent ? p - 1 : p - 1 - exp10) : 0;
     }
-
-    if(print_exponent) {
-      int exponent = get_exponent(dragon, &dragon.exponent);
-      decimal = -dragon.exponent;
-      char * ptr = suffix;
-      *ptr++ = specifier.flags & PRINT_ALLCAPS ? 'E' : 'e';
-      *ptr++ = exponent >= 0 ? '+' : '-';
-      char buf[21];
-      if(exponent < 0) exponent = -exponent;
-      int len = u64toa10(exponent, buf);
-      if(len == 1)
-        *ptr++ = '0';
-      strcpy(ptr, buf);
-      specifier.field_width -= strlen(suffix);
+    if(exponent)
+      len = render_exponent(digits, n, exp10, prec, alter, allcaps, buf, &nzeroes, suffix, &suffix_len);
+    else
+      len = render_fixed(digits, n, exp10, prec, alter, buf, &nzeroes);
+  } else {
+    uint64_t m = u & MANT;
+    int e = -1074;
+    if(raw_exp) {
+      m |= 1ull << 52;
+      e = raw_exp - 1075;
+    }
+    if(m) {
+      int tz = __builtin_ctzll(m);
+      m >>= tz;
+      e += tz;
+    }
+    if(specifier.print_kind == PRINT_DOUBLE) {
+      len = exact_fixed(m, e, prec, buf, &nzeroes);
+      if(!prec && !alter)
+        len--;
+    } else if(specifier.print_kind == PRINT_EXPONENT) {
+      int exp10;
+      int n = exact_significant(m, e, prec + 1, digits, &exp10);
+      len = render_exponent(digits, n, exp10, prec, alter, allcaps, buf, &nzeroes, suffix, &suffix_len);
+    } else {
+      // %g picks its style from the exponent after rounding
+      int p = prec ? prec : 1;
+      int exp10;
+      int n = exact_significant(m, e, p, digits, &exp10);
+      if(!alter)
+        while(n > 1 && digits[n-1] == '0')
+          n--;
+      if(-4 <= exp10 && exp10 < p)
+        len = render_fixed(digits, n, exp10, alter ? p - 1 - exp10 : 0, alter, buf, &nzeroes);
+      else
+        len = render_exponent(digits, n, exp10, alter ? p - 1 : 0, alter, allcaps, buf, &nzeroes, suffix, &suffix_len);
     }
-    if(!(specifier.flags & PRINT_ROUNDTRIP))
-      dragon.significand = truncu(dragon.significand, &dragon.exponent, specifier.precision);
-    len = dtoaz(dragon, buf, &decimal);
-  }
-  // if the decimal hasn't been printed yet
-  //   then if we force the decimal, or we have trailing zeroes to print
-  //   and general doesn't print trailing zeroes
-  bool print_trailing_zeroes = ((specifier.flags & PRINT_ALTER) || (specifier.print_kind != PRINT_GENERAL && specifier.precision));
-  if(decimal == 0 && print_trailing_zeroes) {
-    buf[len] = '.';
-    len++;
-  }
-  int nzeroes = 0;
-  if(print_trailing_zeroes && decimal < specifier.precision) {
-    nzeroes = specifier.precision - decimal;
-    specifier.field_width -= nzeroes;
-  }
-  int ret = print_number(f, sign, buf, len, specifier, 0);
-  while(nzeroes--) {
-    d_fputc_unlocked('0', f);
-    ret++;
-  }
-  if(*suffix) {
-    int len = strlen(suffix);
-    d_fwrite_unlocked(suffix, len, f);
-    ret += len;
   }
-  return ret;
+
+  print_layout l = {
+    .prefix = sign,
+    .prefix_len = sign_len,
+    .body = buf,
+    .body_len = len,
+    .trailing_zeroes = nzeroes,
+    .suffix = suffix,
+    .suffix_len = suffix_len,
+  };
+  return print_layout_out(f, specifier, &l);
 }
-static int print_hexponent(DFILE * f, print_specifier specifier, va_list * args) {
+
+static int print_double(DFILE * f, print_specifier specifier, va_list * args) {
   double d;
   switch(specifier.kind_width) {
   case PRINT_LONGLONG:
@@ -545,139 +915,115 @@ static int print_hexponent(DFILE * f, print_specifier specifier, va_list * args)
   default:
     d = va_arg(*args, double);
   }
-  char prefix[8] = {0};
-  if(d < 0)
-    prefix[0] = '-';
+  return print_double_value(f, specifier, d, is_float_width(specifier));
+}
+
+static int print_hexponent_value(DFILE * f, print_specifier specifier, double d) {
+  bool allcaps = specifier.flags & PRINT_ALLCAPS;
+  uint64_t u;
+  memcpy(&u, &d, sizeof d);
+  char prefix[4];
+  int prefix_len = 0;
+  if(u >> 63)
+    prefix[prefix_len++] = '-';
   else if(specifier.flags & PRINT_SIGN)
-    prefix[0] = '+';
+    prefix[prefix_len++] = '+';
   else if(specifier.flags & PRINT_SPACE)
-    prefix[0] = ' ';
+    prefix[prefix_len++] = ' ';
 
   int decimal = 0;
   int len = 0;
-  char buf[64] = "";
-  char suffix[32] = "";
-  uint64_t u;
-  memcpy(&u, &d, sizeof d);
+  char buf[32];
+  char suffix[32];
+  int suffix_len = 0;
   enum { EXP = (1 << 11) - 1, MANT = (1ull << 52) - 1, };
   if(((u >> 52) & EXP) == EXP) {
     if(u & MANT) {
       len = 3;
-      memcpy(buf, specifier.flags & PRINT_ALLCAPS ? "NAN" : "nan", 4);
-      specifier.flags |= PRINT_ROUNDTRIP;
-      specifier.precision = 0;
+      memcpy(buf, allcaps ? "NAN" : "nan", 3);
     } else {
       len = 3;
-      memcpy(buf, specifier.flags & PRINT_ALLCAPS ? "INF" : "inf", 4);
-      specifier.flags |= PRINT_ROUNDTRIP;
-      specifier.precision = 0;
+      memcpy(buf, allcaps ? "INF" : "inf", 3);
     }
+    specifier.flags |= PRINT_ROUNDTRIP;
+    specifier.precision = 0;
     specifier.flags &= ~PRINT_ZERO_EXTEND;
     specifier.flags &= ~PRINT_ALTER;
-  } else if(d == 0) {
-    strcat(prefix, "0x");
-    char const * zero;
-    char const  * zerosuffix;
-    if(specifier.flags & PRINT_ALLCAPS) {
-      zero = "0";
-      zerosuffix = "P+00";
-    } else {
-      zero = "0";
-      zerosuffix = "p+00";
-    }
-    strcat(buf, zero);
-    len = strlen(zero);
-    strcat(suffix, zerosuffix);
   } else {
-    strcat(prefix, specifier.flags & PRINT_ALLCAPS ? "0X" : "0x");
-    uint64_t rawmant = u & MANT;
+    prefix[prefix_len++] = '0';
+    prefix[prefix_len++] = allcaps ? 'X' : 'x';
     uint64_t mant = u & MANT;
     uint64_t raw_exp = (u >> 52) & EXP;
-    enum { IMPLIED_ONE = (1ull << 52) };
-    int exponent;
-    if(raw_exp) {
-      // normal number
-      exponent = raw_exp - 1023;
-    } else {
-      // subnormal number
-      exponent = -1023;
-      mant = 0;
-      while(!(mant & IMPLIED_ONE)) {
-        exponent--;
-        mant <<= 1;
-      }
-      mant &= ~IMPLIED_ONE;
-    }
-    strcat(buf, "1");
-    len += 1;
+    // subnormals print as 0x0.xxxp-1022, like glibc
+    int lead = raw_exp ? 1 : 0;
+    int exponent = raw_exp ? (int)raw_exp - 1023 : -1022;
+    if(!raw_exp && !mant)
+      exponent = 0;
 
-    if(!(specifier.flags & PRINT_ROUNDTRIP))
-    {
+    int digits = 52 / 4;
+    if(!(specifier.flags & PRINT_ROUNDTRIP)) {
       int lastlast = 0;
       int last = 0;
-      int prec = 52 / 4;
-      while(prec > specifier.precision) {
+      while(digits > specifier.precision) {
         lastlast += last;
         last = mant & 15;
         mant >>= 4;
-        prec--;
+        digits--;
       }
-      if(last > 8 || (last == 8 && (lastlast || ((mant % 16) & 1))))
+      // ties go to even, which is the leading digit once no digits are left
+      bool odd = digits ? mant & 1 : lead & 1;
+      if(last > 8 || (last == 8 && (lastlast || odd)))
         mant += 1;
-      if(mant & IMPLIED_ONE) {
-        exponent++;
-        mant &= ~IMPLIED_ONE;
+      // rounding carried into the leading digit
+      if(mant >> 4*digits) {
+        lead++;
+        mant &= (1ull << 4*digits) - 1;
       }
     }
-
-    while(mant != 0 && (mant & 15) == 0) {
+    while(digits && !(mant & 15)) {
       mant >>= 4;
+      digits--;
     }
 
-    char tmp[65];
-    if(mant) {
-      decimal = u64toa(mant, tmp, 16, specifier.flags & PRINT_ALLCAPS);
-      strcat(buf, ".");
-      len += 1;
-      strcat(buf, tmp);
-      len += decimal;
-    } else {
-      decimal = 0;
+    char const * hex = allcaps ? "0123456789ABCDEF" : "0123456789abcdef";
+    buf[len++] = '0' + lead;
+    if(digits) {
+      buf[len++] = '.';
+      for(int i = digits; i--;)
+        buf[len++] = hex[(mant >> 4*i) & 15];
+      decimal = digits;
     }
 
-    strcat(suffix, specifier.flags & PRINT_ALLCAPS ? "P" : "p");
-
-    if(exponent < 0) {
-      strcat(suffix, "-");
+    suffix[suffix_len++] = allcaps ? 'P' : 'p';
+    suffix[suffix_len++] = exponent < 0 ? '-' : '+';
+    if(exponent < 0)
       exponent = -exponent;
-    } else {
-      strcat(suffix, "+");
-    }
-    int len2 = u64toa10(exponent, tmp);
-    if(len2 == 1)
-      strcat(suffix, "0");
-    strcat(suffix, tmp);
-  }
-  if(((specifier.flags & PRINT_ALTER) || specifier.precision) && decimal == 0) {
-    strcat(buf, ".");
-    len += 1;
-  }
-  int ret = print_number(f, prefix, buf, len, specifier, 0);
-  int nzeroes = 0;
-  if(decimal < specifier.precision) {
-    nzeroes = specifier.precision - decimal;
-    specifier.field_width -= nzeroes;
-  }
-  while(nzeroes--) {
-    d_fputc_unlocked('0', f);
-    ret++;
-  }
-  if(*suffix) {
-    int len = strlen(suffix);
-    d_fwrite_unlocked(suffix, len, f);
-    ret += len;
+    suffix_len += u64toa10(exponent, suffix + suffix_len);
   }
-  return ret;
+  if(((specifier.flags & PRINT_ALTER) || specifier.precision) && decimal == 0)
+    buf[len++] = '.';
+  print_layout l = {
+    .prefix = prefix,
+    .prefix_len = prefix_len,
+    .body = buf,
+    .body_len = len,
+    .trailing_zeroes = decimal < specifier.precision ? specifier.precision - decimal : 0,
+    .suffix = suffix,
+    .suffix_len = suffix_len,
+  };
+  return print_layout_out(f, specifier, &l);
+}
+
+static int print_hexponent(DFILE * f, print_specifier specifier, va_list * args) {
+  double d;
+  switch(specifier.kind_width) {
+  case PRINT_LONGLONG:
+    d = va_arg(*args, long double);
+    break;
+  default:
+    d = va_arg(*args, double);
+  }
+  return print_hexponent_value(f, specifier, d);
 }
 
 uint64_t read_va_uint(print_specifier specifier, va_list* args) {
@@ -805,90 +1151,68 @@ int64_t read_va_int(print_specifier specifier, va_list* args) {
   return i;
 }
 
-static int print_uint10(DFILE * f, print_specifier specifier, va_list* args) {
-  uint64_t u = read_va_uint(specifier, args);
+static int print_uint10(DFILE * f, print_specifier specifier, uint64_t u) {
   char buf[23];
-  int len = u64toa10(u, buf);
-  int ret = 0;
-
-  int nzeroes = specifier.precision - len;
-  if(nzeroes < 0)
-    nzeroes = 0;
-  return print_number(f, "", buf, len, specifier, nzeroes);
+  // a zero precision prints nothing for zero
+  int len = !u && !specifier.precision ? 0 : u64toa10(u, buf);
+  return print_number(f, "", 0, buf, len, specifier);
 }
-static int print_uint(DFILE * f, print_specifier specifier, va_list* args, int base, bool allcaps) {
-  uint64_t u = read_va_uint(specifier, args);
+static int print_uint(DFILE * f, print_specifier specifier, uint64_t u, int base, bool allcaps) {
   char buf[67];
-  int len = u64toa(u, buf, base, allcaps);
-  char prefix[4] = "";
+  int len = !u && !specifier.precision ? 0 : u64toa(u, buf, base, allcaps);
+  char prefix[2];
+  int prefix_len = 0;
   if(specifier.flags & PRINT_ALTER) {
     switch(base) {
       case 2:
-        prefix[0] = '0';
-        prefix[1] = specifier.flags & PRINT_ALLCAPS ? 'B' : 'b';
-        prefix[2] = '\0';
+        if(u) {
+          prefix[prefix_len++] = '0';
+          prefix[prefix_len++] = specifier.flags & PRINT_ALLCAPS ? 'B' : 'b';
+        }
         break;
       case 8:
-        if(u)
-        {
-          prefix[0] = '0';
-          prefix[1] = '\0';
-        }
+        // the alternate form only guarantees a leading zero
+        if(specifier.precision <= len && (u || !len))
+          specifier.precision = len + 1;
         break;
       case 16:
-        prefix[0] = '0';
-        prefix[1] = specifier.flags & PRINT_ALLCAPS ? 'X' : 'x';
-        prefix[2] = '\0';
+        if(u) {
+          prefix[prefix_len++] = '0';
+          prefix[prefix_len++] = specifier.flags & PRINT_ALLCAPS ? 'X' : 'x';
+        }
         break;
     }
   }
-
-  int nzeroes = specifier.precision - len;
-  if(nzeroes < 0)
-    nzeroes = 0;
-  return print_number(f, prefix, buf, len, specifier, nzeroes);
+  return print_number(f, prefix, prefix_len, buf, len, specifier);
 }
 static int print_ptr(DFILE * f, print_specifier specifier, void * ptr) {
   char buf[67];
   int len;
-  char prefix[4] = "";
   if(!ptr) {
-    memcpy(buf, "(nil)", sizeof "(nil)");
-    len = 5;
     specifier.flags &= ~PRINT_ZERO_EXTEND;
-  } else {
-    uint64_t u = (uintptr_t)ptr;
-    len = u64toa(u, buf, 16, false);
-    memcpy(prefix, "0x", sizeof "0x");
+    specifier.precision = -1;
+    return print_number(f, "", 0, "(nil)", 5, specifier);
   }
-
-  int nzeroes = 0;
-  if(ptr) 
-    nzeroes = specifier.precision - len;
-  if(nzeroes < 0)
-    nzeroes = 0;
-  return print_number(f, prefix, buf, len, specifier, nzeroes);
+  len = u64toa((uintptr_t)ptr, buf, 16, false);
+  return print_number(f, "0x", 2, buf, len, specifier);
 }
 
-static int print_int(DFILE * f, print_specifier specifier, va_list* args) {
-  int64_t i = read_va_int(specifier, args);
+static int print_int(DFILE * f, print_specifier specifier, int64_t i) {
   bool neg = i < 0;
-  uint64_t u = neg ? -i : i;
+  uint64_t u = neg ? -(uint64_t)i : (uint64_t)i;
   char buf[22];
-  int len = u64toa10(u, buf);
+  int len = !u && !specifier.precision ? 0 : u64toa10(u, buf);
 
-  char sign[2] = {0};
+  char sign[1];
+  int sign_len = 0;
   if(neg)
-    sign[0] = '-';
+    sign[sign_len++] = '-';
   else if(specifier.flags & PRINT_SIGN)
-    sign[0] = '+';
+    sign[sign_len++] = '+';
   else if(specifier.flags & PRINT_SPACE)
-    sign[0] = ' ';
+    sign[sign_len++] = ' ';
 
-  int nzeroes = specifier.precision - len;
-  if(nzeroes < 0)
-    nzeroes = 0;
-  return print_number(f, sign, buf, len, specifier, nzeroes);
+  return print_number(f, sign, sign_len, buf, len, specifier);
 }
 
 static void print_tell(print_specifier specifier, int nchars, va_list* args) {
@@ -952,48 +1276,412 @@ static void print_tell(print_specifier specifier, int nchars, va_list* args) {
   }
 }
 
-static int print_string(DFILE * f, print_specifier specifier, char const * str) {
-  int len = strlen(str);
-  return print_number(f, "", str, len, specifier, 0);
+// a string's precision is the most bytes printed from it, and nothing
+// past that is read, so it needn't be nul terminated within it
+static size_t string_length(print_specifier specifier, char const * str) {
+  if(specifier.precision < 0)
+    return strlen(str);
+  char const * end = memchr(str, '\0', specifier.precision);
+  return end ? (size_t)(end - str) : (size_t)specifier.precision;
+}
+static size_t slice_length(print_specifier specifier, size_t len) {
+  if(specifier.precision >= 0 && len > (size_t)specifier.precision)
+    return specifier.precision;
+  return len;
 }
 
-static int print_format(DFILE * f, char const ** pfmt, va_list* args, int nchars) {
-  print_specifier specifier = parse_print_specifier(*pfmt, args, false);
-  *pfmt = *pfmt + specifier.chars_consumed;
-  switch(specifier.print_kind) {
-    case PRINT_PERCENT: {
-      if(d_fputc_unlocked('%', f) < 0)
-        return -1;
-      return 1;
+// a %S slice's length is a size_t, but what printf returns is an int
+static int print_string(DFILE * f, print_specifier specifier, char const * str, size_t len) {
+  if(len > INT_MAX) {
+    errno = EOVERFLOW;
+    return -1;
+  }
+  if(specifier.field_width <= (int)len)
+    return d_fwrite_ref_impl(f, str, len) == (int)len ? (int)len : -1;
+  specifier.precision = -1;
+  return print_number(f, "", 0, str, len, specifier);
+}
+
+// byte buffer conversions, which take the buffer's length as the
+// width. the encoders work a chunk at a time straight into the stream's
+// buffer, or through the stack when it can't reserve the room
+static char const hex_digits[] = "0123456789abcdef";
+
+// writes the 2 * n lowercase hex digits of src
+static void hex_encode(char * dst, unsigned char const * src, size_t n) {
+#ifdef __SSE2__
+  __m128i const mask = _mm_set1_epi8(0x0f);
+  __m128i const nine = _mm_set1_epi8(9);
+  __m128i const zero = _mm_set1_epi8('0');
+  __m128i const gap = _mm_set1_epi8('a' - '0' - 10);
+  for(; n >= 16; n -= 16, src += 16, dst += 32) {
+    __m128i v = _mm_loadu_si128((__m128i const *)src);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo = _mm_and_si128(v, mask);
+    __m128i a = _mm_unpacklo_epi8(hi, lo);
+    __m128i b = _mm_unpackhi_epi8(hi, lo);
+    a = _mm_add_epi8(_mm_add_epi8(a, zero), _mm_and_si128(_mm_cmpgt_epi8(a, nine), gap));
+    b = _mm_add_epi8(_mm_add_epi8(b, zero), _mm_and_si128(_mm_cmpgt_epi8(b, nine), gap));
+    _mm_storeu_si128((__m128i *)dst, a);
+    _mm_storeu_si128((__m128i *)(dst + 16), b);
+  }
+#endif
+  for(; n; n--, src++) {
+    *dst++ = hex_digits[*src >> 4];
+    *dst++ = hex_digits[*src & 15];
+  }
+}
+
+// encoders return the bytes written for n bytes of input found at
+// offset into the whole buffer
+typedef size_t encode_function(char * dst, unsigned char const * src, size_t n, size_t offset);
+
+static size_t hex_chunk(char * dst, unsigned char const * src, size_t n, size_t offset) {
+  (void)offset;
+  hex_encode(dst, src, n);
+  return 2 * n;
+}
+
+// xxd's layout: offset, 8 groups of 2 bytes, then the printable chars
+enum { HEXDUMP_LINE = 68 };
+static size_t hexdump_chunk(char * dst, unsigned char const * src, size_t n, size_t offset) {
+  char * start = dst;
+  for(size_t line = 0; line < n; line += 16) {
+    size_t len = n - line < 16 ? n - line : 16;
+    uint32_t at = offset + line;
+    for(int i = 7; i >= 0; i--, at >>= 4)
+      dst[i] = hex_digits[at & 15];
+    dst[8] = ':';
+    dst[9] = ' ';
+    dst += 10;
+    char hex[32];
+    hex_encode(hex, src + line, len);
+    memset(dst, ' ', 41);
+    for(size_t i = 0; i < len; i++)
+      memcpy(dst + 2 * i + i / 2, hex + 2 * i, 2);
+    dst += 41;
+    for(size_t i = 0; i < len; i++) {
+      unsigned char c = src[line + i];
+      *dst++ = c >= ' ' && c <= '~' ? c : '.';
     }
-    case PRINT_CHAR: {
-      if(specifier.kind_width == PRINT_LONG)
+    *dst++ = '\n';
+  }
+  return dst - start;
+}
+
+// chunk is the input per step and out_max the most it encodes to
+static int print_encoded(DFILE * f, unsigned char const * src, size_t n,
+                         size_t chunk, size_t out_max, encode_function * encode) {
+  char tmp[2304];
+  int printed = 0;
+  for(size_t offset = 0; offset < n; offset += chunk) {
+    size_t step = n - offset < chunk ? n - offset : chunk;
+    char * out = d_freserve_unlocked(f, out_max);
+    if(out) {
+      size_t len = encode(out, src + offset, step, offset);
+      if(d_fcommit_unlocked(f, len) < 0)
         return -1;
-      char arr[2] = { va_arg(*args, int), 0 };
-      return print_string(f, specifier, arr);
-    }
-    case PRINT_STRING: {
-      if(specifier.kind_width == PRINT_LONG)
+      printed += len;
+    } else {
+      size_t len = encode(tmp, src + offset, step, offset);
+      if(d_fwrite_unlocked(tmp, len, f) != (int)len)
         return -1;
-      char const * str = va_arg(*args, char*);
-      return print_string(f, specifier, str);
+      printed += len;
     }
-    case PRINT_ERROR: {
-      char * str = strerror(errno);
-      return print_string(f, specifier, str);
-    }
-    case PRINT_BINARY:
-      return print_uint(f, specifier, args, 2, false);
-    case PRINT_OCTAL:
-      return print_uint(f, specifier, args, 8, false);
-    case PRINT_HEX:
-      return print_uint(f, specifier, args, 16, specifier.flags & PRINT_ALLCAPS);
-    case PRINT_UINT:
-      return print_uint10(f, specifier, args);
-    case PRINT_POINTER:
+  }
+  return printed;
+}
+
+// chunks are a multiple of 3 so only the last one pads
+static size_t base64_chunk(char * dst, unsigned char const * src, size_t n, size_t offset) {
+  (void)offset;
+  return d_base64_encode_impl(dst, src, n);
+}
+
+static int print_buffer(DFILE * f, print_specifier specifier, void const * buf, size_t n) {
+  if(specifier.print_kind == PRINT_HEXDUMP)
+    return print_encoded(f, buf, n, 512, 32 * HEXDUMP_LINE, hexdump_chunk);
+  if(specifier.print_kind == PRINT_BASE64)
+    return print_encoded(f, buf, n, 1536, 2048, base64_chunk);
+  return print_encoded(f, buf, n, 1024, 2048, hex_chunk);
+}
+
+// %<json> and d_fput_json_string: a quoted json string, with ", \ and
+// the control characters escaped. everything else, utf-8 included, is
+// copied through in runs found 16 bytes at a time
+static size_t json_clean_run(char const * s, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i const quote = _mm_set1_epi8('"');
+  __m128i const backslash = _mm_set1_epi8('\\');
+  __m128i const control = _mm_set1_epi8(0x1f);
+  for(; n - i >= 16; i += 16) {
+    __m128i v = _mm_loadu_si128((__m128i const *)(s + i));
+    __m128i bad = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+    // unsigned v <= 0x1f
+    bad = _mm_or_si128(bad, _mm_cmpeq_epi8(_mm_max_epu8(v, control), control));
+    int mask = _mm_movemask_epi8(bad);
+    if(mask)
+      return i + __builtin_ctz(mask);
+  }
+#endif
+  for(; i < n; i++) {
+    unsigned char c = s[i];
+    if(c < 0x20 || c == '"' || c == '\\')
+      break;
+  }
+  return i;
+}
+
+static int json_escape(char * dst, unsigned char c) {
+  static char const short_escapes[32] = {
+    ['\b'] = 'b', ['\f'] = 'f', ['\n'] = 'n', ['\r'] = 'r', ['\t'] = 't'
+  };
+  dst[0] = '\\';
+  if(c >= 0x20) {
+    dst[1] = c;
+    return 2;
+  }
+  if(short_escapes[c]) {
+    dst[1] = short_escapes[c];
+    return 2;
+  }
+  memcpy(dst + 1, "u00", 3);
+  dst[4] = hex_digits[c >> 4];
+  dst[5] = hex_digits[c & 15];
+  return 6;
+}
+
+// a NULL str prints json's null
+static int print_json(DFILE * f, char const * str, size_t len) {
+  if(!str)
+    return d_fwrite_unlocked("null", 4, f) == 4 ? 4 : -1;
+  if(d_fputc_unlocked('"', f) < 0)
+    return -1;
+  int printed = 2;
+  for(size_t i = 0; i < len;) {
+    size_t run = json_clean_run(str + i, len - i < INT_MAX ? len - i : INT_MAX);
+    if(run && d_fwrite_ref_impl(f, str + i, run) != (int)run)
+      return -1;
+    printed += run;
+    i += run;
+    if(i == len)
+      break;
+    char esc[6];
+    int n = json_escape(esc, str[i++]);
+    if(d_fwrite_unlocked(esc, n, f) != n)
+      return -1;
+    printed += n;
+  }
+  if(d_fputc_unlocked('"', f) < 0)
+    return -1;
+  return printed;
+}
+
+int d_fput_json_string_unlocked(char const * str, size_t len, DFILE * f) {
+  return print_json(f, str, len);
+}
+int d_fput_json_string(char const * str, size_t len, DFILE * f) {
+  d_flockfile_impl(f);
+  int ret = print_json(f, str, len);
+  d_funlockfile_impl(f);
+  return ret;
+}
+
+// %<time>: the current time in iso 8601, utc unless the # flag asks for
+// local time, with precision fractional digits, 3 by default. the text
+// up to the seconds is cached per thread, so most calls only format the
+// fraction
+static int time_coarse;
+
+int d_settimecoarse(int coarse) {
+#ifndef CLOCK_REALTIME_COARSE
+  if(coarse) {
+    errno = ENOTSUP;
+    return -1;
+  }
+#endif
+  return __atomic_exchange_n(&time_coarse, !!coarse, __ATOMIC_RELAXED);
+}
+
+static void time_now(int64_t * sec, int32_t * nsec) {
+  struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+  if(__atomic_load_n(&time_coarse, __ATOMIC_RELAXED))
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  else
+#endif
+  timespec_get(&ts, TIME_UTC);
+  *sec = ts.tv_sec;
+  *nsec = ts.tv_nsec;
+}
+
+typedef struct time_prefix {
+  int64_t sec;
+  int len;
+  char text[32];
+  char suffix[8];
+} time_prefix;
+// one for utc and one for local time
+static _Thread_local time_prefix time_prefixes[2] = { { .sec = INT64_MIN }, { .sec = INT64_MIN } };
+
+static time_prefix * find_time_prefix(int64_t sec, bool local) {
+  time_prefix * p = &time_prefixes[local];
+  if(p->sec == sec)
+    return p;
+  time_t t = sec;
+  struct tm tm, utc;
+#ifdef _WIN64
+  gmtime_s(&utc, &t);
+  if(local)
+    localtime_s(&tm, &t);
+#else
+  gmtime_r(&t, &utc);
+  if(local)
+    localtime_r(&t, &tm);
+#endif
+  if(!local)
+    tm = utc;
+  p->len = d_snprintf(p->text, sizeof p->text, "%04d-%02d-%02dT%02d:%02d:%02d",
+                      tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+                      tm.tm_hour, tm.tm_min, tm.tm_sec);
+  if(!local) {
+    strcpy(p->suffix, "Z");
+  } else {
+    int days = tm.tm_year != utc.tm_year ? tm.tm_year - utc.tm_year : tm.tm_yday - utc.tm_yday;
+    int offset = days * 1440 + (tm.tm_hour - utc.tm_hour) * 60 + tm.tm_min - utc.tm_min;
+    int mag = offset < 0 ? -offset : offset;
+    d_snprintf(p->suffix, sizeof p->suffix, "%c%02d:%02d", offset < 0 ? '-' : '+', mag / 60, mag % 60);
+  }
+  p->sec = sec;
+  return p;
+}
+
+static int print_time(DFILE * f, print_specifier specifier, int64_t sec, int32_t nsec) {
+  static int32_t const pow10[10] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+  };
+  int digits = specifier.precision < 0 ? 3 : specifier.precision > 9 ? 9 : specifier.precision;
+  time_prefix * p = find_time_prefix(sec, specifier.flags & PRINT_ALTER);
+  char buf[64];
+  memcpy(buf, p->text, p->len);
+  int len = p->len;
+  if(digits) {
+    buf[len++] = '.';
+    int32_t frac = nsec / pow10[9 - digits];
+    for(int i = digits; i > 0; i--, frac /= 10)
+      buf[len + i - 1] = '0' + frac % 10;
+    len += digits;
+  }
+  for(char const * c = p->suffix; *c; c++)
+    buf[len++] = *c;
+  specifier.precision = -1;
+  if(specifier.field_width <= len)
+    return d_fwrite_unlocked(buf, len, f) == len ? len : -1;
+  return print_number(f, "", 0, buf, len, specifier);
+}
+
+// registered %<label> formatters, open addressed by an fnv-1a hash of
+// the label. labels are stored inline so a lookup touches one slot
+enum { CUSTOM_SLOTS = 256, CUSTOM_LABEL_MAX = 32 };
+typedef struct custom_printer {
+  d_printf_function_t * fn;
+  int len;
+  char label[CUSTOM_LABEL_MAX];
+} custom_printer;
+static custom_printer custom_printers[CUSTOM_SLOTS];
+
+static uint32_t hash_label(char const * label, int len) {
+  uint32_t h = 2166136261u;
+  for(int i = 0; i < len; i++)
+    h = (h ^ (unsigned char)label[i]) * 16777619u;
+  return h;
+}
+
+// returns the label's slot, or the empty slot it would go in, or NULL
+// if the table is full
+static custom_printer * find_custom_printer(char const * label, int len) {
+  uint32_t h = hash_label(label, len);
+  for(int i = 0; i < CUSTOM_SLOTS; i++) {
+    custom_printer * p = &custom_printers[(h + i) % CUSTOM_SLOTS];
+    if(!p->len || (p->len == len && !memcmp(p->label, label, len)))
+      return p;
+  }
+  return NULL;
+}
+
+int d_register_printf(char const * label, d_printf_function_t * fn) {
+  size_t len = strlen(label);
+  if(!len || len >= CUSTOM_LABEL_MAX || strchr(label, '>')) {
+    errno = EINVAL;
+    return -1;
+  }
+  custom_printer * p = find_custom_printer(label, len);
+  if(!p) {
+    errno = ENOMEM;
+    return -1;
+  }
+  memcpy(p->label, label, len);
+  p->fn = fn;
+  p->len = len;
+  return 0;
+}
+
+static int print_custom(DFILE * f, print_specifier specifier, va_list * args) {
+  int len = specifier.label_end - specifier.label;
+  if(len >= CUSTOM_LABEL_MAX)
+    return -1;
+  custom_printer * p = find_custom_printer(specifier.label, len);
+  if(!p || !p->fn)
+    return -1;
+  // whatever the callback writes may be its own temporaries, so they're
+  // copied rather than gathered
+  bool gather = d_fgather_begin_impl(f, false);
+  int ret = p->fn(f, &specifier, args);
+  d_fgather_end_impl(f, gather);
+  return ret;
+}
+
+static int print_conversion(DFILE * f, print_specifier specifier, va_list* args, int nchars) {
+  switch(specifier.print_kind) {
+    case PRINT_PERCENT: {
+      if(d_fputc_unlocked('%', f) < 0)
+        return -1;
+      return 1;
+    }
+    case PRINT_CHAR: {
+      if(specifier.kind_width == PRINT_LONG)
+        return -1;
+      char c = va_arg(*args, int);
+      return print_string(f, specifier, &c, 1);
+    }
+    case PRINT_STRING: {
+      if(specifier.kind_width == PRINT_LONG)
+        return -1;
+      char const * str = va_arg(*args, char*);
+      return print_string(f, specifier, str, string_length(specifier, str));
+    }
+    case PRINT_SLICE: {
+      char const * str = va_arg(*args, char const*);
+      size_t len = va_arg(*args, size_t);
+      return print_string(f, specifier, str, slice_length(specifier, len));
+    }
+    case PRINT_ERROR: {
+      char * str = strerror(errno);
+      return print_string(f, specifier, str, string_length(specifier, str));
+    }
+    case PRINT_BINARY:
+      return print_uint(f, specifier, read_va_uint(specifier, args), 2, false);
+    case PRINT_OCTAL:
+      return print_uint(f, specifier, read_va_uint(specifier, args), 8, false);
+    case PRINT_HEX:
+      return print_uint(f, specifier, read_va_uint(specifier, args), 16, specifier.flags & PRINT_ALLCAPS);
+    case PRINT_UINT:
+      return print_uint10(f, specifier, read_va_uint(specifier, args));
+    case PRINT_POINTER:
       return print_ptr(f, specifier, va_arg(*args, void*));
     case PRINT_INT:
-      return print_int(f, specifier, args);
+      return print_int(f, specifier, read_va_int(specifier, args));
     case PRINT_DOUBLE:
     case PRINT_EXPONENT:
     case PRINT_GENERAL:
@@ -1003,41 +1691,489 @@ static int print_format(DFILE * f, char const ** pfmt, va_list* args, int nchars
     case PRINT_TELL:
       print_tell(specifier, nchars, args);
       return 0;
+    case PRINT_CUSTOM:
+      return print_custom(f, specifier, args);
+    case PRINT_JSON: {
+      char const * str = va_arg(*args, char const*);
+      return print_json(f, str, str ? string_length(specifier, str) : 0);
+    }
+    case PRINT_TIME: {
+      int64_t sec;
+      int32_t nsec;
+      time_now(&sec, &nsec);
+      return print_time(f, specifier, sec, nsec);
+    }
+    case PRINT_HEXBUF:
+    case PRINT_HEXDUMP:
+    case PRINT_BASE64:
+      return print_buffer(f, specifier, va_arg(*args, void const*), specifier.field_width);
+    default:
+      return -1;
+  }
+}
+
+// typed entry points for formats parsed ahead of time, so the value is
+// passed directly instead of through a va_list. the specifier can't
+// take * arguments
+static bool resolve_typed_specifier(print_specifier * specifier) {
+  if(specifier->flags & (PRINT_WIDTH_ARG | PRINT_PRECISION_ARG))
+    return false;
+  resolve_print_specifier(specifier, NULL);
+  return true;
+}
+
+int d_fprint_int_unlocked(DFILE * f, print_specifier const * spec, int64_t i) {
+  print_specifier specifier = *spec;
+  if(!resolve_typed_specifier(&specifier))
+    return -1;
+  switch(specifier.print_kind) {
+    case PRINT_INT:
+      return print_int(f, specifier, i);
+    case PRINT_CHAR: {
+      char c = i;
+      return print_string(f, specifier, &c, 1);
+    }
+    default:
+      return d_fprint_uint_unlocked(f, spec, i);
+  }
+}
+int d_fprint_uint_unlocked(DFILE * f, print_specifier const * spec, uint64_t u) {
+  print_specifier specifier = *spec;
+  if(!resolve_typed_specifier(&specifier))
+    return -1;
+  switch(specifier.print_kind) {
+    case PRINT_INT:
+      if(u <= INT64_MAX)
+        return print_int(f, specifier, u);
+      return print_uint10(f, specifier, u);
+    case PRINT_UINT:
+      return print_uint10(f, specifier, u);
+    case PRINT_BINARY:
+      return print_uint(f, specifier, u, 2, false);
+    case PRINT_OCTAL:
+      return print_uint(f, specifier, u, 8, false);
+    case PRINT_HEX:
+      return print_uint(f, specifier, u, 16, specifier.flags & PRINT_ALLCAPS);
+    case PRINT_CHAR: {
+      char c = u;
+      return print_string(f, specifier, &c, 1);
+    }
+    default:
+      return -1;
+  }
+}
+static int print_typed_double(DFILE * f, print_specifier const * spec, double d, bool is_float) {
+  print_specifier specifier = *spec;
+  if(!resolve_typed_specifier(&specifier))
+    return -1;
+  switch(specifier.print_kind) {
+    case PRINT_DOUBLE:
+    case PRINT_EXPONENT:
+    case PRINT_GENERAL:
+      return print_double_value(f, specifier, d, is_float);
+    case PRINT_HEXPONENT:
+      return print_hexponent_value(f, specifier, d);
     default:
       return -1;
   }
 }
+int d_fprint_double_unlocked(DFILE * f, print_specifier const * spec, double d) {
+  return print_typed_double(f, spec, d, false);
+}
+int d_fprint_float_unlocked(DFILE * f, print_specifier const * spec, float d) {
+  return print_typed_double(f, spec, d, true);
+}
+int d_fprint_str_unlocked(DFILE * f, print_specifier const * spec, char const * str, size_t len) {
+  print_specifier specifier = *spec;
+  if(!resolve_typed_specifier(&specifier) || specifier.print_kind != PRINT_STRING)
+    return -1;
+  return print_string(f, specifier, str, slice_length(specifier, len));
+}
+int d_fprint_ptr_unlocked(DFILE * f, print_specifier const * spec, void const * ptr) {
+  print_specifier specifier = *spec;
+  if(!resolve_typed_specifier(&specifier) || specifier.print_kind != PRINT_POINTER)
+    return -1;
+  return print_ptr(f, specifier, (void*)ptr);
+}
+
+// format free emitters behind d_print, with printf's defaults
+int d_fput_i64_unlocked(int64_t i, DFILE * f) {
+  print_specifier specifier = { .print_kind = PRINT_INT, .precision = -1 };
+  return print_int(f, specifier, i);
+}
+int d_fput_u64_unlocked(uint64_t u, DFILE * f) {
+  print_specifier specifier = { .print_kind = PRINT_UINT, .precision = -1 };
+  return print_uint10(f, specifier, u);
+}
+// shortest roundtrip digits, like %rg
+int d_fput_f64_unlocked(double d, DFILE * f) {
+  print_specifier specifier = { .print_kind = PRINT_GENERAL, .flags = PRINT_ROUNDTRIP, .precision = 6 };
+  return print_double_value(f, specifier, d, false);
+}
+int d_fput_f32_unlocked(float d, DFILE * f) {
+  print_specifier specifier = { .print_kind = PRINT_GENERAL, .flags = PRINT_ROUNDTRIP, .precision = 6 };
+  return print_double_value(f, specifier, d, true);
+}
+int d_fput_str_unlocked(char const * str, DFILE * f) {
+  int len = strlen(str);
+  return d_fwrite_unlocked(str, len, f) == len ? len : -1;
+}
+
+int d_fput_i64(int64_t i, DFILE * f) {
+  d_flockfile_impl(f);
+  int ret = d_fput_i64_unlocked(i, f);
+  d_funlockfile_impl(f);
+  return ret;
+}
+int d_fput_u64(uint64_t u, DFILE * f) {
+  d_flockfile_impl(f);
+  int ret = d_fput_u64_unlocked(u, f);
+  d_funlockfile_impl(f);
+  return ret;
+}
+int d_fput_f64(double d, DFILE * f) {
+  d_flockfile_impl(f);
+  int ret = d_fput_f64_unlocked(d, f);
+  d_funlockfile_impl(f);
+  return ret;
+}
+int d_fput_f32(float d, DFILE * f) {
+  d_flockfile_impl(f);
+  int ret = d_fput_f32_unlocked(d, f);
+  d_funlockfile_impl(f);
+  return ret;
+}
+int d_fput_str(char const * str, DFILE * f) {
+  d_flockfile_impl(f);
+  int ret = d_fput_str_unlocked(str, f);
+  d_funlockfile_impl(f);
+  return ret;
+}
+
+static int print_format(DFILE * f, char const ** pfmt, va_list* args, int nchars) {
+  print_specifier specifier = parse_print_specifier(*pfmt, args, false);
+  *pfmt = *pfmt + specifier.chars_consumed;
+  return print_conversion(f, specifier, args, nchars);
+}
 
 #if defined(_WIN64) || defined(__EMSCRIPTEN__)
 #define VA_POINTER(x) (&x)
 #else
 #define VA_POINTER(x) ((va_list*)x)
 #endif
-static int  dvfprintf_impl(DFILE * f, char  const * fmt, va_list *args) {
-  d_flockfile(f);
-  int printed = 0;
-  char c;
-  while((c = *fmt++)) {
-    switch(c) {
-      case '%': {
-        int ret = print_format(f, &fmt, args, printed);
-        if(ret < 0) {
-          d_funlockfile(f);
-          return -1;
-        }
-        printed += ret;
-        break;
+// a compiled format is a list of literal runs, each followed by an
+// already parsed conversion. the format string is copied in after the
+// ops since the literals and labels point into it
+typedef struct d_fmt_op {
+  char const * text;
+  int text_len;
+  bool has_specifier;
+  print_specifier specifier;
+} d_fmt_op;
+
+// a compiled format's id stands in for its address in deferred
+// records, since a freed format's address can be reused. the top bit
+// keeps ids apart from the addresses of literal formats
+struct d_fmt {
+  int nops;
+  uint64_t id;
+  char const * fmt;
+  d_fmt_op ops[];
+};
+
+// deferred streams (d_fsetdeferred) get binary records instead of text,
+// which d_fdecode_deferred renders later. the first time a stream sees
+// a format, its text goes out as
+//   'F', u64 id, u32 len, text
+// and each printf is
+//   'L', u64 id, u32 len, arguments
+// with the id being the format's address, or a d_fmt's id. the
+// arguments are in the order the format takes them: * widths and
+// precisions as 4 bytes, integers and pointers widened to 8, floats as
+// doubles, chars as 1, and strings as a u32 length and their bytes. %m
+// and %<label> are rendered to strings up front. all in native byte
+// order. anything else written to the stream goes in as
+//   'R', u64 0, u32 len, bytes
+enum { DEFER_FORMAT = 'F', DEFER_LOG = 'L', DEFER_RAW = 'R', DEFER_HEAD = 13, DEFER_CUSTOM_ROOM = 256 };
+
+typedef struct defer_buf {
+  char * data;
+  size_t len;
+  size_t cap;
+  char storage[512];
+} defer_buf;
+
+// makes room for len more bytes past b->len
+static bool defer_reserve(defer_buf * b, size_t len) {
+  if(b->len + len > b->cap) {
+    size_t cap = b->cap * 2 > b->len + len ? b->cap * 2 : b->len + len;
+    char * data = b->data == b->storage ? malloc(cap) : realloc(b->data, cap);
+    if(!data)
+      return false;
+    if(b->data == b->storage)
+      memcpy(data, b->storage, b->len);
+    b->data = data;
+    b->cap = cap;
+  }
+  return true;
+}
+static bool defer_put(defer_buf * b, void const * src, size_t len) {
+  if(!defer_reserve(b, len))
+    return false;
+  memcpy(b->data + b->len, src, len);
+  b->len += len;
+  return true;
+}
+static bool defer_put_string(defer_buf * b, char const * str, size_t len) {
+  // UINT32_MAX is a NULL json string
+  if(len >= UINT32_MAX)
+    return false;
+  uint32_t n = len;
+  return defer_put(b, &n, sizeof n) && defer_put(b, str, len);
+}
+
+typedef struct custom_args {
+  print_specifier specifier;
+  va_list * args;
+} custom_args;
+
+static int custom_sink(DFILE * f, void * ctx) {
+  custom_args * a = ctx;
+  return print_custom(f, a->specifier, a->args);
+}
+
+static bool defer_conversion(defer_buf * b, print_specifier specifier, va_list * args) {
+  int32_t width = 0, precision = 0;
+  if(specifier.flags & PRINT_WIDTH_ARG) {
+    width = va_arg(*args, int);
+    if(!defer_put(b, &width, sizeof width))
+      return false;
+  }
+  if(specifier.flags & PRINT_PRECISION_ARG) {
+    precision = va_arg(*args, int);
+    if(!defer_put(b, &precision, sizeof precision))
+      return false;
+  }
+  switch(specifier.print_kind) {
+    case PRINT_PERCENT:
+      return true;
+    case PRINT_CHAR: {
+      if(specifier.kind_width == PRINT_LONG)
+        return false;
+      char c = va_arg(*args, int);
+      return defer_put(b, &c, 1);
+    }
+    case PRINT_STRING: {
+      if(specifier.kind_width == PRINT_LONG)
+        return false;
+      char const * str = va_arg(*args, char*);
+      resolve_print_specifier_args(&specifier, width, precision);
+      return defer_put_string(b, str, string_length(specifier, str));
+    }
+    case PRINT_SLICE: {
+      char const * str = va_arg(*args, char const*);
+      size_t len = va_arg(*args, size_t);
+      resolve_print_specifier_args(&specifier, width, precision);
+      return defer_put_string(b, str, slice_length(specifier, len));
+    }
+    case PRINT_HEXBUF:
+    case PRINT_HEXDUMP:
+    case PRINT_BASE64: {
+      void const * buf = va_arg(*args, void const*);
+      resolve_print_specifier_args(&specifier, width, precision);
+      return defer_put_string(b, buf, specifier.field_width);
+    }
+    case PRINT_JSON: {
+      // a NULL string is recorded with an impossible length
+      char const * str = va_arg(*args, char const*);
+      resolve_print_specifier_args(&specifier, width, precision);
+      if(!str) {
+        uint32_t null = UINT32_MAX;
+        return defer_put(b, &null, sizeof null);
       }
-      default:
-        if(d_fputc_unlocked(c, f) < 0) {
-          d_funlockfile(f);
-          return -1;
-        }
-        printed++;
+      return defer_put_string(b, str, string_length(specifier, str));
+    }
+    case PRINT_TIME: {
+      // the time of the call, not of decoding
+      int64_t sec;
+      int32_t nsec;
+      time_now(&sec, &nsec);
+      return defer_put(b, &sec, sizeof sec) && defer_put(b, &nsec, sizeof nsec);
+    }
+    case PRINT_ERROR: {
+      char const * str = strerror(errno);
+      resolve_print_specifier_args(&specifier, width, precision);
+      return defer_put_string(b, str, string_length(specifier, str));
+    }
+    case PRINT_BINARY:
+    case PRINT_OCTAL:
+    case PRINT_HEX:
+    case PRINT_UINT: {
+      uint64_t u = read_va_uint(specifier, args);
+      return defer_put(b, &u, sizeof u);
+    }
+    case PRINT_INT: {
+      int64_t i = read_va_int(specifier, args);
+      return defer_put(b, &i, sizeof i);
+    }
+    case PRINT_POINTER: {
+      uint64_t u = (uintptr_t)va_arg(*args, void*);
+      return defer_put(b, &u, sizeof u);
+    }
+    case PRINT_DOUBLE:
+    case PRINT_EXPONENT:
+    case PRINT_GENERAL:
+    case PRINT_HEXPONENT: {
+      double d;
+      if(specifier.kind_width == PRINT_LONGLONG)
+        d = va_arg(*args, long double);
+      else
+        d = va_arg(*args, double);
+      return defer_put(b, &d, sizeof d);
+    }
+    case PRINT_TELL:
+      // nothing is printed yet to count
+      print_tell(specifier, 0, args);
+      return true;
+    case PRINT_CUSTOM: {
+      // the callback takes arguments of types only it knows, so it runs
+      // now, straight into the record after its length. if it needs
+      // more room it runs again on a copy of its arguments
+      custom_args a = { specifier, args };
+      resolve_print_specifier_args(&a.specifier, width, precision);
+      uint32_t n = 0;
+      size_t at = b->len;
+      if(!defer_put(b, &n, sizeof n) || !defer_reserve(b, DEFER_CUSTOM_ROOM))
+        return false;
+      va_list again;
+      va_copy(again, *args);
+      int len = d_fsink_impl(b->data + b->len, b->cap - b->len, custom_sink, &a);
+      if(len >= 0 && (size_t)len >= b->cap - b->len) {
+        a.args = &again;
+        len = defer_reserve(b, (size_t)len + 1) ?
+          d_fsink_impl(b->data + b->len, b->cap - b->len, custom_sink, &a) : -1;
       }
+      va_end(again);
+      // a callback that printed more the second time is an error
+      if(len < 0 || (size_t)len >= b->cap - b->len)
+        return false;
+      n = len;
+      memcpy(b->data + at, &n, sizeof n);
+      b->len += len;
+      return true;
+    }
+    default:
+      return false;
   }
-  d_funlockfile(f);
+}
+
+static void defer_head(char * head, char tag, uint64_t id, uint32_t len) {
+  head[0] = tag;
+  memcpy(head + 1, &id, sizeof id);
+  memcpy(head + 9, &len, sizeof len);
+}
+
+static int write_defer_record(DFILE * f, char tag, uint64_t id, void const * data, uint32_t len) {
+  char head[DEFER_HEAD];
+  defer_head(head, tag, id, len);
+  if(d_fwrite_record_impl(f, head, sizeof head) != sizeof head)
+    return -1;
+  if(d_fwrite_record_impl(f, data, len) != (int)len)
+    return -1;
+  return 0;
+}
+
+__attribute__((visibility("hidden")))
+int d_fdeferred_raw_impl(DFILE * f, void const * ptr, int ct) {
+  if(ct < 0)
+    return -1;
+  if(ct == 0)
+    return 0;
+  return write_defer_record(f, DEFER_RAW, 0, ptr, ct) < 0 ? -1 : ct;
+}
+
+// the stream is the ring: the format is parsed once per stream and the
+// parse kept, so a printf copies its arguments after a header and the
+// record goes into the stream's buffer in one write, which only makes
+// a syscall when the buffer fills. prog is the caller's compiled
+// format, or NULL to use the stream's own. returns 0 or -1
+static int dvfprintf_deferred(DFILE * f, char const * fmt, d_fmt const * prog, va_list * args) {
+  defer_buf b;
+  b.data = b.storage;
+  b.len = DEFER_HEAD;
+  b.cap = sizeof b.storage;
+  int ret = -1;
+  uint64_t id = prog ? prog->id : (uintptr_t)fmt;
+
+  d_flockfile_impl(f);
+  d_fmt * plan = NULL;
+  bool seen = d_fdeferred_lookup_impl(f, id, &plan);
+  bool fresh = false;
+  if(!prog && !plan) {
+    if(!(plan = d_fmt_compile(fmt)))
+      goto done;
+    fresh = true;
+  }
+  if(!seen && write_defer_record(f, DEFER_FORMAT, id, fmt, strlen(fmt)) < 0)
+    goto done;
+  // the stream owns the plan once it's remembered
+  if((!seen || fresh) && d_fdeferred_remember_impl(f, id, plan))
+    fresh = false;
+  if(!prog)
+    prog = plan;
+  for(int i = 0; i < prog->nops; i++) {
+    d_fmt_op const * op = &prog->ops[i];
+    if(op->has_specifier && !defer_conversion(&b, op->specifier, args))
+      goto done;
+  }
+  if(b.len > INT_MAX)
+    goto done;
+  defer_head(b.data, DEFER_LOG, id, b.len - DEFER_HEAD);
+  if(d_fwrite_record_impl(f, b.data, b.len) == (int)b.len)
+    ret = 0;
+done:
+  d_funlockfile_impl(f);
+  if(fresh)
+    d_fmt_free(plan);
+  if(b.data != b.storage)
+    free(b.data);
+  return ret;
+}
+
+static int  dvfprintf_impl(DFILE * f, char  const * fmt, va_list *args) {
+  if(d_fdeferred_impl(f))
+    return dvfprintf_deferred(f, fmt, NULL, args);
+  d_flockfile_impl(f);
+  // large literal runs and strings are written from where they are
+  bool gather = d_fgather_begin_impl(f, true);
+  int printed = 0;
+  while(*fmt) {
+    if(*fmt == '%') {
+      fmt++;
+      int ret = print_format(f, &fmt, args, printed);
+      if(ret < 0)
+        goto fail;
+      printed += ret;
+      continue;
+    }
+    // write the literal text up to the next conversion in one go
+    char const * end = strchr(fmt, '%');
+    if(!end)
+      end = fmt + strlen(fmt);
+    int len = end - fmt;
+    if(d_fwrite_ref_impl(f, fmt, len) != len)
+      goto fail;
+    printed += len;
+    fmt = end;
+  }
+  if(d_fgather_end_impl(f, gather) < 0)
+    printed = -1;
+  d_funlockfile_impl(f);
   return printed;
+fail:
+  d_fgather_end_impl(f, gather);
+  d_funlockfile_impl(f);
+  return -1;
 }
 int d_vfprintf(DFILE * f, char const * fmt, va_list args) {
   return dvfprintf_impl(f, fmt, VA_POINTER(args));
@@ -1062,23 +2198,238 @@ int d_vprintf(char const * fmt, va_list args) {
   return ret;
 }
 
-static _Thread_local DFILE * sprintf_stream;
+d_fmt * d_fmt_compile(char const * fmt) {
+  size_t len = strlen(fmt);
+  int nops = 1;
+  for(char const * c = fmt; *c; c++)
+    nops += *c == '%';
+  d_fmt * prog = malloc(sizeof(d_fmt) + nops * sizeof(d_fmt_op) + len + 1);
+  if(!prog)
+    return NULL;
+  static uint64_t next_id;
+  prog->id = (uint64_t)1 << 63 | __atomic_add_fetch(&next_id, 1, __ATOMIC_RELAXED);
+  char * str = (char*)&prog->ops[nops];
+  memcpy(str, fmt, len + 1);
+  prog->fmt = str;
 
-int d_vsnprintf(char * buf, size_t size, char const * fmt, va_list args) {
-  if(!sprintf_stream) {
-    sprintf_stream = d_fmemopen(buf, size, "w0+");
-    if(!sprintf_stream)
-      return -1;
-  } else if(!d_fmemreopen(buf, size, "w0+", sprintf_stream)) {
+  int n = 0;
+  d_fmt_op * op = &prog->ops[0];
+  *op = (d_fmt_op) { .text = str };
+  while(*str) {
+    if(*str != '%') {
+      char const * end = strchr(str, '%');
+      if(!end)
+        end = str + strlen(str);
+      op->text_len += end - str;
+      str += end - str;
+      continue;
+    }
+    print_specifier specifier = parse_print_specifier_raw(str + 1, false);
+    if(specifier.print_kind == PRINT_MALFORMED) {
+      free(prog);
+      errno = EINVAL;
+      return NULL;
+    }
+    if(specifier.print_kind == PRINT_PERCENT) {
+      // the first % is the literal, continue the run after the second
+      op->text_len++;
+      str += 1 + specifier.chars_consumed;
+      if(op->text + op->text_len != str) {
+        op = &prog->ops[++n];
+        *op = (d_fmt_op) { .text = str };
+      }
+      continue;
+    }
+    op->has_specifier = true;
+    op->specifier = specifier;
+    str += 1 + specifier.chars_consumed;
+    op = &prog->ops[++n];
+    *op = (d_fmt_op) { .text = str };
+  }
+  prog->nops = op->text_len ? n + 1 : n;
+  return prog;
+}
+
+void d_fmt_free(d_fmt * prog) {
+  free(prog);
+}
+
+static int dvfprintf_compiled_impl(DFILE * f, d_fmt const * prog, va_list * args) {
+  if(d_fdeferred_impl(f))
+    return dvfprintf_deferred(f, prog->fmt, prog, args);
+  d_flockfile_impl(f);
+  bool gather = d_fgather_begin_impl(f, true);
+  int printed = 0;
+  for(int i = 0; i < prog->nops; i++) {
+    d_fmt_op const * op = &prog->ops[i];
+    if(op->text_len) {
+      if(d_fwrite_ref_impl(f, op->text, op->text_len) != op->text_len)
+        goto fail;
+      printed += op->text_len;
+    }
+    if(op->has_specifier) {
+      print_specifier specifier = op->specifier;
+      resolve_print_specifier(&specifier, args);
+      int ret = print_conversion(f, specifier, args, printed);
+      if(ret < 0)
+        goto fail;
+      printed += ret;
+    }
+  }
+  if(d_fgather_end_impl(f, gather) < 0)
+    printed = -1;
+  d_funlockfile_impl(f);
+  return printed;
+fail:
+  d_fgather_end_impl(f, gather);
+  d_funlockfile_impl(f);
+  return -1;
+}
+int d_vfprintf_compiled(DFILE * f, d_fmt const * prog, va_list args) {
+  return dvfprintf_compiled_impl(f, prog, VA_POINTER(args));
+}
+int d_fprintf_compiled(DFILE * f, d_fmt const * prog, ...) {
+  va_list args;
+  va_start(args, prog);
+  int ret = d_vfprintf_compiled(f, prog, args);
+  va_end(args);
+  return ret;
+}
+
+// the bulk printers apply one conversion, like "%.3f", to a whole
+// array. it can't take * arguments
+static int parse_bulk_specifier(char const * spec, print_specifier * specifier) {
+  if(spec[0] != '%')
+    goto fail;
+  *specifier = parse_print_specifier_raw(spec + 1, false);
+  if(spec[1 + specifier->chars_consumed] != '\0')
+    goto fail;
+  if(specifier->flags & (PRINT_WIDTH_ARG | PRINT_PRECISION_ARG))
+    goto fail;
+  resolve_print_specifier(specifier, NULL);
+  return 0;
+fail:
+  errno = EINVAL;
+  return -1;
+}
+
+enum { BULK_F32, BULK_F64, BULK_I32, BULK_I64 };
+
+static bool bulk_kind_ok(print_specifier specifier, int type) {
+  switch(specifier.print_kind) {
+    case PRINT_DOUBLE:
+    case PRINT_EXPONENT:
+    case PRINT_GENERAL:
+      return type == BULK_F32 || type == BULK_F64;
+    case PRINT_INT:
+    case PRINT_UINT:
+    case PRINT_BINARY:
+    case PRINT_OCTAL:
+    case PRINT_HEX:
+      return type == BULK_I32 || type == BULK_I64;
+    default:
+      return false;
+  }
+}
+
+static int print_bulk_element(DFILE * f, print_specifier specifier, void const * arr, size_t i, int type) {
+  if(type == BULK_F32)
+    return print_double_value(f, specifier, ((float const*)arr)[i], true);
+  if(type == BULK_F64)
+    return print_double_value(f, specifier, ((double const*)arr)[i], false);
+
+  // unsigned conversions see the two's complement bits, like printf
+  int64_t i64;
+  uint64_t u64;
+  if(type == BULK_I32) {
+    i64 = ((int32_t const*)arr)[i];
+    u64 = (uint32_t)i64;
+  } else {
+    i64 = ((int64_t const*)arr)[i];
+    u64 = i64;
+  }
+  switch(specifier.print_kind) {
+    case PRINT_INT:
+      return print_int(f, specifier, i64);
+    case PRINT_UINT:
+      return print_uint10(f, specifier, u64);
+    case PRINT_BINARY:
+      return print_uint(f, specifier, u64, 2, false);
+    case PRINT_OCTAL:
+      return print_uint(f, specifier, u64, 8, false);
+    default:
+      return print_uint(f, specifier, u64, 16, specifier.flags & PRINT_ALLCAPS);
+  }
+}
+
+static int print_bulk(DFILE * f, void const * arr, size_t n, int type, char const * sep, char const * spec) {
+  print_specifier specifier;
+  if(parse_bulk_specifier(spec, &specifier) < 0)
     return -1;
+  if(!bulk_kind_ok(specifier, type)) {
+    errno = EINVAL;
+    return -1;
+  }
+  int sep_len = sep ? strlen(sep) : 0;
+  d_flockfile_impl(f);
+  int printed = 0;
+  for(size_t i = 0; i < n; i++) {
+    if(i && sep_len) {
+      if(d_fwrite_unlocked(sep, sep_len, f) != sep_len)
+        goto fail;
+      printed += sep_len;
+    }
+    int ret = print_bulk_element(f, specifier, arr, i, type);
+    if(ret < 0)
+      goto fail;
+    printed += ret;
   }
-  int ret = dvfprintf_impl(sprintf_stream, fmt, VA_POINTER(args));
-  d_fflush_unlocked(sprintf_stream);
-  d_fmemreopen(NULL, 0, "w0+", sprintf_stream);
-  if(size && ret >= size)
-    buf[size-1] = '\0';
+  d_funlockfile_impl(f);
+  return printed;
+fail:
+  d_funlockfile_impl(f);
+  return -1;
+}
+
+int d_fprint_f32s(DFILE * f, float const * arr, size_t n, char const * sep, char const * spec) {
+  return print_bulk(f, arr, n, BULK_F32, sep, spec);
+}
+int d_fprint_f64s(DFILE * f, double const * arr, size_t n, char const * sep, char const * spec) {
+  return print_bulk(f, arr, n, BULK_F64, sep, spec);
+}
+int d_fprint_i32s(DFILE * f, int32_t const * arr, size_t n, char const * sep, char const * spec) {
+  return print_bulk(f, arr, n, BULK_I32, sep, spec);
+}
+int d_fprint_i64s(DFILE * f, int64_t const * arr, size_t n, char const * sep, char const * spec) {
+  return print_bulk(f, arr, n, BULK_I64, sep, spec);
+}
+
+typedef struct vprintf_args {
+  char const * fmt;
+  va_list * args;
+} vprintf_args;
+
+static int vprintf_sink(DFILE * f, void * ctx) {
+  vprintf_args * a = ctx;
+  return dvfprintf_impl(f, a->fmt, a->args);
+}
+
+int d_vsnprintf(char * buf, size_t size, char const * fmt, va_list args) {
+  vprintf_args a = { fmt, VA_POINTER(args) };
+  return d_fsink_impl(buf, size, vprintf_sink, &a);
+}
+int d_vprintf_len(char const * fmt, va_list args) {
+  vprintf_args a = { fmt, VA_POINTER(args) };
+  return d_fsink_impl(NULL, 0, vprintf_sink, &a);
+}
+int d_printf_len(char const * fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  int ret = d_vprintf_len(fmt, args);
+  va_end(args);
   return ret;
 }
+
 int d_snprintf(char * buf, size_t size, char const * fmt, ...) {
   va_list args;
   va_start(args, fmt);
@@ -1098,18 +2449,51 @@ int d_sprintf(char * buf, char const * fmt, ...) {
   return ret;
 }
 
-int d_vasprintf(char ** buf, char const * fmt, va_list args) {
-  size_t size;
-  if(!sprintf_stream) {
-    sprintf_stream = d_open_memstream(buf, &size);
-    if(!sprintf_stream)
-      return -1;
-  } else if(!d_reopen_memstream(buf, &size, sprintf_stream)) {
+// formats into a stack buffer first so only output too long for it is
+// formatted twice, the second time straight into the allocation. the
+// second pass can still come out shorter (%m, a label), so its count is
+// the one returned. *buf is set whenever there was an allocation
+static int dvasprintf_impl(char ** buf, d_arena_alloc_function_t * alloc, void * cookie,
+                           char const * fmt, va_list * args, va_list * again) {
+  char tmp[256];
+  vprintf_args a = { fmt, args };
+  int len = d_fsink_impl(tmp, sizeof tmp, vprintf_sink, &a);
+  if(len < 0)
     return -1;
+  // so %m sees the same errno on both passes
+  int saved_errno = errno;
+  char * ret = alloc(cookie, (size_t)len + 1);
+  errno = saved_errno;
+  if(!ret)
+    return -1;
+  *buf = ret;
+  if((size_t)len < sizeof tmp) {
+    memcpy(ret, tmp, len + 1);
+    return len;
   }
-  int ret = dvfprintf_impl(sprintf_stream, fmt, VA_POINTER(args));
-  d_fflush_unlocked(sprintf_stream);
-  d_fmemreopen(NULL, 0, "w0+", sprintf_stream);
+  a.args = again;
+  int n = d_fsink_impl(ret, (size_t)len + 1, vprintf_sink, &a);
+  if(n < 0)
+    return -1;
+  // longer the second time is cut at the allocation
+  return n < len ? n : len;
+}
+
+static void * malloc_alloc(void * cookie, size_t size) {
+  (void)cookie;
+  return malloc(size);
+}
+
+int d_vasprintf(char ** buf, char const * fmt, va_list args) {
+  char * out = NULL;
+  va_list again;
+  va_copy(again, args);
+  int ret = dvasprintf_impl(&out, malloc_alloc, NULL, fmt, VA_POINTER(args), VA_POINTER(again));
+  va_end(again);
+  if(ret < 0)
+    free(out);
+  else
+    *buf = out;
   return ret;
 }
 int d_asprintf(char ** buf, char const * fmt, ...) {
@@ -1119,3 +2503,270 @@ int d_asprintf(char ** buf, char const * fmt, ...) {
   va_end(args);
   return ret;
 }
+
+char * d_vasprintf_arena(d_arena const * arena, char const * fmt, va_list args) {
+  char * buf = NULL;
+  va_list again;
+  va_copy(again, args);
+  int ret = dvasprintf_impl(&buf, arena->alloc, arena->cookie, fmt, VA_POINTER(args), VA_POINTER(again));
+  va_end(again);
+  return ret < 0 ? NULL : buf;
+}
+char * d_asprintf_arena(d_arena const * arena, char const * fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  char * ret = d_vasprintf_arena(arena, fmt, args);
+  va_end(args);
+  return ret;
+}
+
+// the decoder's formats by id, open addressed, growing at half full
+typedef struct defer_format {
+  uint64_t id;
+  char * text;
+} defer_format;
+
+typedef struct defer_dict {
+  defer_format * slots;
+  size_t cap;
+  size_t count;
+} defer_dict;
+
+static defer_format * defer_dict_find(defer_dict * d, uint64_t id) {
+  size_t i = (id ^ (id >> 17)) * 0x9E3779B97F4A7C15ull >> 7;
+  for(;; i++) {
+    defer_format * slot = &d->slots[i & (d->cap - 1)];
+    if(!slot->text || slot->id == id)
+      return slot;
+  }
+}
+
+static bool defer_dict_insert(defer_dict * d, uint64_t id, char * text) {
+  if(2 * (d->count + 1) > d->cap) {
+    defer_dict grown = { calloc(d->cap ? 2 * d->cap : 64, sizeof(defer_format)), d->cap ? 2 * d->cap : 64, d->count };
+    if(!grown.slots)
+      return false;
+    for(size_t i = 0; i < d->cap; i++)
+      if(d->slots[i].text)
+        *defer_dict_find(&grown, d->slots[i].id) = d->slots[i];
+    free(d->slots);
+    *d = grown;
+  }
+  defer_format * slot = defer_dict_find(d, id);
+  if(slot->text)
+    free(slot->text);
+  else
+    d->count++;
+  *slot = (defer_format) { id, text };
+  return true;
+}
+
+typedef struct defer_reader {
+  char const * cur;
+  char const * end;
+} defer_reader;
+
+static bool defer_get(defer_reader * r, void * dst, size_t len) {
+  if((size_t)(r->end - r->cur) < len)
+    return false;
+  memcpy(dst, r->cur, len);
+  r->cur += len;
+  return true;
+}
+
+// reads a string argument in place, the reader owns the bytes
+static bool defer_get_string(defer_reader * r, char const ** str, uint32_t * len) {
+  if(!defer_get(r, len, sizeof *len) || (size_t)(r->end - r->cur) < *len)
+    return false;
+  *str = r->cur;
+  r->cur += *len;
+  return true;
+}
+
+static int render_deferred_conversion(DFILE * f, print_specifier specifier, defer_reader * r) {
+  int32_t width = 0, precision = 0;
+  if(specifier.flags & PRINT_WIDTH_ARG && !defer_get(r, &width, sizeof width))
+    return -1;
+  if(specifier.flags & PRINT_PRECISION_ARG && !defer_get(r, &precision, sizeof precision))
+    return -1;
+  resolve_print_specifier_args(&specifier, width, precision);
+  switch(specifier.print_kind) {
+    case PRINT_PERCENT:
+      return d_fputc_unlocked('%', f) < 0 ? -1 : 1;
+    case PRINT_CHAR: {
+      char c;
+      if(!defer_get(r, &c, 1))
+        return -1;
+      return print_string(f, specifier, &c, 1);
+    }
+    case PRINT_TIME: {
+      int64_t sec;
+      int32_t nsec;
+      if(!defer_get(r, &sec, sizeof sec) || !defer_get(r, &nsec, sizeof nsec))
+        return -1;
+      return print_time(f, specifier, sec, nsec);
+    }
+    case PRINT_JSON: {
+      uint32_t len;
+      if(!defer_get(r, &len, sizeof len))
+        return -1;
+      if(len == UINT32_MAX)
+        return print_json(f, NULL, 0);
+      if((size_t)(r->end - r->cur) < len)
+        return -1;
+      r->cur += len;
+      return print_json(f, r->cur - len, len);
+    }
+    case PRINT_STRING:
+    case PRINT_SLICE:
+    case PRINT_ERROR:
+    case PRINT_CUSTOM:
+    case PRINT_HEXBUF:
+    case PRINT_HEXDUMP:
+    case PRINT_BASE64: {
+      char const * str;
+      uint32_t len;
+      if(!defer_get_string(r, &str, &len))
+        return -1;
+      if(is_buffer_kind(specifier.print_kind))
+        return print_buffer(f, specifier, str, len);
+      // the custom printer already laid itself out
+      if(specifier.print_kind == PRINT_CUSTOM)
+        return d_fwrite_unlocked(str, len, f) == (int)len ? (int)len : -1;
+      return print_string(f, specifier, str, len);
+    }
+    case PRINT_BINARY:
+    case PRINT_OCTAL:
+    case PRINT_HEX:
+    case PRINT_UINT:
+    case PRINT_POINTER: {
+      uint64_t u;
+      if(!defer_get(r, &u, sizeof u))
+        return -1;
+      switch(specifier.print_kind) {
+        case PRINT_BINARY:
+          return print_uint(f, specifier, u, 2, false);
+        case PRINT_OCTAL:
+          return print_uint(f, specifier, u, 8, false);
+        case PRINT_HEX:
+          return print_uint(f, specifier, u, 16, specifier.flags & PRINT_ALLCAPS);
+        case PRINT_POINTER:
+          return print_ptr(f, specifier, (void*)(uintptr_t)u);
+        default:
+          return print_uint10(f, specifier, u);
+      }
+    }
+    case PRINT_INT: {
+      int64_t i;
+      if(!defer_get(r, &i, sizeof i))
+        return -1;
+      return print_int(f, specifier, i);
+    }
+    case PRINT_DOUBLE:
+    case PRINT_EXPONENT:
+    case PRINT_GENERAL:
+    case PRINT_HEXPONENT: {
+      double d;
+      if(!defer_get(r, &d, sizeof d))
+        return -1;
+      if(specifier.print_kind == PRINT_HEXPONENT)
+        return print_hexponent_value(f, specifier, d);
+      return print_double_value(f, specifier, d, is_float_width(specifier));
+    }
+    case PRINT_TELL:
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+static int render_deferred(DFILE * f, char const * fmt, defer_reader * r) {
+  while(*fmt) {
+    if(*fmt == '%') {
+      print_specifier specifier = parse_print_specifier_raw(fmt + 1, false);
+      fmt += 1 + specifier.chars_consumed;
+      if(render_deferred_conversion(f, specifier, r) < 0)
+        return -1;
+      continue;
+    }
+    char const * end = strchr(fmt, '%');
+    if(!end)
+      end = fmt + strlen(fmt);
+    int len = end - fmt;
+    if(d_fwrite_unlocked(fmt, len, f) != len)
+      return -1;
+    fmt = end;
+  }
+  return r->cur == r->end ? 0 : -1;
+}
+
+static bool defer_read(DFILE * f, void * buf, size_t len) {
+  return d_fread_unlocked(buf, len, f) == (int)len;
+}
+
+int d_fdecode_deferred(DFILE * in, DFILE * out) {
+  defer_dict dict = { 0 };
+  char * body = NULL;
+  size_t body_cap = 0;
+  int records = 0;
+  d_flockfile_impl(in);
+  d_flockfile_impl(out);
+  for(;;) {
+    char head[DEFER_HEAD];
+    int got = d_fread_unlocked(head, sizeof head, in);
+    if(got == 0)
+      break;
+    uint64_t id;
+    uint32_t len;
+    memcpy(&id, head + 1, sizeof id);
+    memcpy(&len, head + 9, sizeof len);
+    if(got != sizeof head ||
+       (head[0] != DEFER_FORMAT && head[0] != DEFER_LOG && head[0] != DEFER_RAW))
+      goto fail;
+    if((size_t)len + 1 > body_cap) {
+      char * grown = realloc(body, (size_t)len + 1);
+      if(!grown)
+        goto fail;
+      body = grown;
+      body_cap = (size_t)len + 1;
+    }
+    if(!defer_read(in, body, len))
+      goto fail;
+
+    if(head[0] == DEFER_RAW) {
+      if(d_fwrite_unlocked(body, len, out) != (int)len)
+        goto fail;
+      continue;
+    }
+    if(head[0] == DEFER_FORMAT) {
+      char * text = malloc((size_t)len + 1);
+      if(!text)
+        goto fail;
+      memcpy(text, body, len);
+      text[len] = '\0';
+      if(!defer_dict_insert(&dict, id, text)) {
+        free(text);
+        goto fail;
+      }
+      continue;
+    }
+    defer_format * format = dict.cap ? defer_dict_find(&dict, id) : NULL;
+    if(!format || !format->text)
+      goto fail;
+    defer_reader r = { body, body + len };
+    if(render_deferred(out, format->text, &r) < 0)
+      goto fail;
+    records++;
+  }
+  goto done;
+fail:
+  records = -1;
+done:
+  d_funlockfile_impl(out);
+  d_funlockfile_impl(in);
+  for(size_t i = 0; i < dict.cap; i++)
+    free(dict.slots[i].text);
+  free(dict.slots);
+  free(body);
+  return records;
+}
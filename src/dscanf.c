@@ -31,13 +31,16 @@
 __attribute__((visibility("hidden")))
 print_specifier parse_print_specifier(char const * fmt, va_list* args, bool is_scan);
 
+__attribute__((visibility("hidden")))
+void d_flockfile_impl(DFILE * f);
+__attribute__((visibility("hidden")))
+void d_funlockfile_impl(DFILE * f);
+
 static int skip_whitespace(DFILE * f, int *chars_scanned) {
   for(;;) {
     int ret = d_fgetc_unlocked(f);
-    if(ret < 0) {
-      d_funlockfile(f);
+    if(ret < 0)
       return -1;
-    }
     if(!strchr(" \f\n\r\t\v", ret)) {
       d_ungetc(ret, f);
       break;
@@ -816,7 +819,7 @@ static int scan_format(DFILE * f, char const ** pfmt, va_list* args, int *fields
 #define VA_POINTER(x) ((va_list*)x)
 #endif
 int d_vfscanf_impl(DFILE * f, char const * fmt, va_list* args) {
-  d_flockfile(f);
+  d_flockfile_impl(f);
   int fields_scanned = 0;
   int chars_scanned = 0;
   char c;
@@ -825,11 +828,11 @@ int d_vfscanf_impl(DFILE * f, char const * fmt, va_list* args) {
       case '%': {
         int ret = scan_format(f, &fmt, args, &fields_scanned, &chars_scanned);
         if(ret < 0) {
-          d_funlockfile(f);
+          d_funlockfile_impl(f);
           return fields_scanned ? fields_scanned : -1;
         }
         if(ret == 0) {
-          d_funlockfile(f);
+          d_funlockfile_impl(f);
           return fields_scanned;
         }
         break;
@@ -841,7 +844,7 @@ int d_vfscanf_impl(DFILE * f, char const * fmt, va_list* args) {
       case '\t':
       case '\v': {
         if(skip_whitespace(f, &chars_scanned) < 0) {
-          d_funlockfile(f);
+          d_funlockfile_impl(f);
           return fields_scanned ? fields_scanned : -1;
         }
         break;
@@ -849,12 +852,12 @@ int d_vfscanf_impl(DFILE * f, char const * fmt, va_list* args) {
       default: {
         int ret = d_fgetc_unlocked(f);
         if(ret < 0) {
-          d_funlockfile(f);
+          d_funlockfile_impl(f);
           return fields_scanned ? fields_scanned : -1;
         }
         if(ret != c) {
           d_ungetc(ret, f);
-          d_funlockfile(f);
+          d_funlockfile_impl(f);
           return fields_scanned;
         }
         chars_scanned += 1;
@@ -862,7 +865,7 @@ int d_vfscanf_impl(DFILE * f, char const * fmt, va_list* args) {
       }
     }
   }
-  d_funlockfile(f);
+  d_funlockfile_impl(f);
   return fields_scanned;
 }
 int d_vfscanf(DFILE * f, char const * fmt, va_list args) {
@@ -0,0 +1,21 @@
+#include "dfile.h"
+
+// renders a log written by a stream in deferred mode, see d_fsetdeferred
+// usage: dlogcat [file], reading stdin without a file
+int main(int argc, char ** argv) {
+  DFILE * in = dstdin;
+  if(argc > 1) {
+    in = d_fopen(argv[1], "r");
+    if(!in) {
+      d_fprintf(dstderr, "dlogcat: %s: %m\n", argv[1]);
+      return 1;
+    }
+  }
+  int ret = d_fdecode_deferred(in, dstdout);
+  d_fflush(dstdout);
+  if(ret < 0) {
+    d_fprintf(dstderr, "dlogcat: malformed or truncated log\n");
+    return 1;
+  }
+  return 0;
+}